@@ -19,13 +19,583 @@
 */
 
 #include <assert.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <popt.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <cal.h>
 #include "config.h"
+#include "trace.h"
+
+#ifdef MULTICALL
+#include "multicall.h"
+#define main cal_tool_main
+#endif
+
+#ifdef CAL_DLOPEN
+#include <dlfcn.h>
+
+/* libcal, loaded on first cal_init() so other tools never pay for it */
+static struct {
+	void *handle;
+	__typeof__(cal_init) *init;
+	__typeof__(cal_read_block) *read_block;
+	__typeof__(cal_write_block) *write_block;
+	__typeof__(cal_finish) *finish;
+} libcal;
+
+static int libcal_init(struct cal **c) {
+	if (libcal.handle == NULL) {
+		void *handle = dlopen(LIBCAL_SONAME, RTLD_NOW | RTLD_LOCAL);
+		if (handle == NULL) {
+			fprintf(stderr, "Could not load libcal: %s\n", dlerror());
+			return -1;
+		}
+		/* POSIX way of storing dlsym() result in a function pointer */
+		*(void **)&libcal.init = dlsym(handle, "cal_init");
+		*(void **)&libcal.read_block = dlsym(handle, "cal_read_block");
+		*(void **)&libcal.write_block = dlsym(handle, "cal_write_block");
+		*(void **)&libcal.finish = dlsym(handle, "cal_finish");
+		if (libcal.init == NULL || libcal.read_block == NULL ||
+				libcal.write_block == NULL || libcal.finish == NULL) {
+			fputs("Could not load libcal: CAL functions missing\n", stderr);
+			dlclose(handle);
+			return -1;
+		}
+		libcal.handle = handle;
+	}
+	return libcal.init(c);
+}
+
+#define cal_init libcal_init
+#define cal_read_block libcal.read_block
+#define cal_write_block libcal.write_block
+#define cal_finish libcal.finish
+#endif
+
+#ifndef __user
+#define __user
+#endif
+#include <mtd/mtd-user.h>
+
+/*
+ * CAL partition layout: a sequence of blocks, each a header followed by
+ * len bytes of data, starting on a 4 byte boundary. Writing a block
+ * appends a new version of it; the one with the highest version and
+ * valid checksums is current. Header fields are little endian:
+ *   0 magic "ConF", 4 header version, 5 flags, 6 block version (16 bit),
+ *   8 name (16 chars, NUL terminated only when shorter), 24 len,
+ *   28 CRC32 of data, 32 CRC32 of the 32 bytes before it.
+ * libcal keeps blocks of the user and write protected areas apart, by
+ * where they are stored rather than by header. Where that split lies
+ * hasn't been checked against libcal on a device dump yet, so reading an
+ * image is experimental: it is searched as a whole, a name stored in both
+ * areas reading as the higher version of the two, and user area reads
+ * (CAL_FLAG_USER) are refused rather than risk differing from libcal.
+ * Checked against samples/cal.img only, which is synthesized.
+ */
+#define CAL_HEADER_MAGIC "ConF"
+#define CAL_HEADER_SIZE 36
+#define CAL_NAME_MAX 16
+#define CAL_ALIGN 4
+/* Bytes per pread() from a partition image that isn't an mtd device */
+#define CAL_READ_CHUNK (64 * 1024)
+
+/* Current version of one block, in a slot of the name index */
+struct cal_entry {
+	const uint8_t *header; /* NULL for free slot */
+	uint16_t version;
+};
+
+/* CAL partition read into memory, with current blocks indexed by name */
+struct cal_image {
+	uint8_t *data;
+	size_t size;
+	struct cal_entry *slots; /* open addressing hash table */
+	size_t mask; /* slot count - 1, a power of two */
+};
+
+static uint16_t read_le16(const uint8_t *p) {
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t read_le32(const uint8_t *p) {
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* CRC-32 as used by zlib, reflected polynomial 0xedb88320 */
+static uint32_t crc32(const uint8_t *p, size_t len) {
+	static uint32_t table[256];
+	if (table[1] == 0) {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t crc = i;
+			for (int bit = 0; bit < 8; bit++) {
+				crc = crc & 1 ? crc >> 1 ^ 0xedb88320 : crc >> 1;
+			}
+			table[i] = crc;
+		}
+	}
+	uint32_t crc = 0xffffffff;
+	while (len--) {
+		crc = crc >> 8 ^ table[(crc ^ *p++) & 0xff];
+	}
+	return crc ^ 0xffffffff;
+}
+
+/* FNV-1a hash of block name */
+static size_t cal_hash(const char *name, const size_t len) {
+	uint32_t hash = 2166136261U;
+	for (size_t i = 0; i < len; i++) {
+		hash = (hash ^ (uint8_t)name[i]) * 16777619U;
+	}
+	return hash;
+}
+
+/* Length of name in header, which is only NUL terminated when shorter than 16 */
+static size_t cal_header_name_len(const uint8_t *header) {
+	const uint8_t *end = memchr(header + 8, '\0', CAL_NAME_MAX);
+	return end != NULL ? (size_t)(end - header - 8) : CAL_NAME_MAX;
+}
+
+/* Returns slot for block name, free if it isn't indexed */
+static struct cal_entry *cal_slot(const struct cal_image *img, const char *name,
+		const size_t len) {
+	for (size_t i = cal_hash(name, len);; i++) {
+		struct cal_entry *entry = &img->slots[i & img->mask];
+		if (entry->header == NULL || (cal_header_name_len(entry->header) == len &&
+				memcmp(entry->header + 8, name, len) == 0)) {
+			return entry;
+		}
+	}
+}
+
+/* Returns length of valid block at offset, 0 if there is none */
+static size_t cal_block_at(const struct cal_image *img, const size_t offset) {
+	const uint8_t *header = img->data + offset;
+	if (img->size - offset < CAL_HEADER_SIZE ||
+			memcmp(header, CAL_HEADER_MAGIC, 4) != 0 ||
+			read_le32(header + 32) != crc32(header, 32)) {
+		return 0;
+	}
+	const uint32_t len = read_le32(header + 24);
+	if (len > img->size - offset - CAL_HEADER_SIZE ||
+			read_le32(header + 28) != crc32(header + CAL_HEADER_SIZE, len)) {
+		return 0;
+	}
+	return CAL_HEADER_SIZE + len;
+}
+
+/*
+ * Scans image once for valid blocks and indexes the highest version of
+ * each, later blocks winning ties like appended writes do.
+ */
+static int cal_image_index(struct cal_image *img) {
+	size_t count = 0;
+	for (size_t offset = 0; offset < img->size; ) {
+		const size_t len = cal_block_at(img, offset);
+		count += len > 0;
+		offset += len > 0 ? (len + CAL_ALIGN - 1) & ~(size_t)(CAL_ALIGN - 1) : CAL_ALIGN;
+	}
+	/* at most half full */
+	size_t slots = 16;
+	while (slots < 2 * count) {
+		slots *= 2;
+	}
+	img->slots = calloc(slots, sizeof(*img->slots));
+	if (img->slots == NULL) {
+		perror("Could not allocate CAL index");
+		return EXIT_FAILURE;
+	}
+	img->mask = slots - 1;
+	for (size_t offset = 0; offset < img->size; ) {
+		const size_t len = cal_block_at(img, offset);
+		if (len > 0) {
+			const uint8_t *header = img->data + offset;
+			struct cal_entry *entry = cal_slot(img, (const char *)header + 8,
+				cal_header_name_len(header));
+			const uint16_t version = read_le16(header + 6);
+			if (entry->header == NULL || version >= entry->version) {
+				entry->header = header;
+				entry->version = version;
+			}
+		}
+		offset += len > 0 ? (len + CAL_ALIGN - 1) & ~(size_t)(CAL_ALIGN - 1) : CAL_ALIGN;
+	}
+	return EXIT_SUCCESS;
+}
+
+static void cal_image_free(struct cal_image *img) {
+	if (img == NULL) {
+		return;
+	}
+	free(img->data);
+	free(img->slots);
+	free(img);
+}
+
+/*
+ * Reads whole CAL partition at path, an image file or /dev/mtdN, with
+ * large sequential preads and indexes it. Bad eraseblocks of mtd
+ * devices read as erased.
+ */
+static struct cal_image *cal_image_open(const char *path) {
+	const int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror("Could not open CAL image");
+		return NULL;
+	}
+	struct cal_image *img = calloc(1, sizeof(*img));
+	struct mtd_info_user info;
+	struct stat st;
+	size_t chunk = CAL_READ_CHUNK;
+	bool mtd = false;
+	if (img == NULL) {
+		perror("Could not allocate CAL image");
+	} else if (ioctl(fd, MEMGETINFO, &info) == 0) {
+		mtd = true;
+		img->size = info.size;
+		chunk = info.erasesize ? info.erasesize : chunk;
+	} else if (fstat(fd, &st) == 0) {
+		img->size = st.st_size;
+	} else {
+		perror("Could not stat CAL image");
+		cal_image_free(img);
+		img = NULL;
+	}
+	if (img != NULL && (img->data = malloc(img->size ? img->size : 1)) == NULL) {
+		perror("Could not allocate CAL image");
+		cal_image_free(img);
+		img = NULL;
+	}
+	for (size_t offset = 0; img != NULL && offset < img->size; ) {
+		const size_t len = img->size - offset < chunk ? img->size - offset : chunk;
+		loff_t bad_offset = offset;
+		ssize_t got;
+		if (mtd && ioctl(fd, MEMGETBADBLOCK, &bad_offset) > 0) {
+			memset(img->data + offset, 0xff, len);
+			got = len;
+		} else {
+			got = pread(fd, img->data + offset, len, offset);
+		}
+		if (got <= 0) {
+			if (got < 0) {
+				perror("Could not read CAL image");
+			} else {
+				fputs("CAL image ended early\n", stderr);
+			}
+			cal_image_free(img);
+			img = NULL;
+		} else {
+			offset += got;
+		}
+	}
+	close(fd);
+	if (img != NULL && cal_image_index(img) != EXIT_SUCCESS) {
+		cal_image_free(img);
+		img = NULL;
+	}
+	return img;
+}
+
+/*
+ * Finds current version of block name in either area, see the layout
+ * above. Data points into image. Returns 0 on success, like cal_read_block().
+ */
+static int cal_image_find(const struct cal_image *img, const char *name,
+		const void **data, unsigned long *len) {
+	const size_t name_len = strlen(name);
+	if (name_len > CAL_NAME_MAX) {
+		return -1;
+	}
+	const struct cal_entry *entry = cal_slot(img, name, name_len);
+	if (entry->header == NULL) {
+		return -1;
+	}
+	*data = entry->header + CAL_HEADER_SIZE;
+	*len = read_le32(entry->header + 24);
+	return 0;
+}
+
+/* Source of CAL blocks, libcal or a partition image read natively */
+struct cal_source {
+	struct cal *cal;
+	struct cal_image *image;
+};
+
+/* Opens libcal, or for non-NULL path the partition image there */
+static int source_open(struct cal_source *src, const char *path) {
+	const uint64_t start = trace_now();
+	src->cal = NULL;
+	src->image = NULL;
+	int ret;
+	if (path != NULL) {
+		src->image = cal_image_open(path);
+		ret = src->image != NULL ? 0 : -1;
+	} else {
+		ret = cal_init(&src->cal);
+	}
+	if (ret == 0) {
+		trace_end("cal_init", path != NULL ? path : "libcal", start);
+	} else {
+		trace_error("cal_init", path != NULL ? path : "libcal", "failed", start);
+	}
+	return ret;
+}
+
+static void source_close(struct cal_source *src) {
+	if (src->cal != NULL) {
+		cal_finish(src->cal);
+	}
+	cal_image_free(src->image);
+}
+
+/* Reads block like cal_read_block(), *data to be freed by caller */
+static int source_read(const struct cal_source *src, const char *name,
+		void **data, unsigned long *len, const unsigned long flags) {
+	const uint64_t start = trace_now();
+	const void *found;
+	int ret;
+	if (src->cal != NULL) {
+		ret = cal_read_block(src->cal, name, data, len, flags);
+	} else if (flags & CAL_FLAG_USER) {
+		/* images don't tell the areas apart yet, see the layout above */
+		ret = -1;
+	} else if (cal_image_find(src->image, name, &found, len) != 0) {
+		ret = -1;
+	} else if ((*data = malloc(*len ? *len : 1)) == NULL) {
+		ret = -1;
+	} else {
+		memcpy(*data, found, *len);
+		ret = 0;
+	}
+	if (ret == 0) {
+		trace_end("read", name, start);
+	} else {
+		trace_error("read", name, "failed", start);
+	}
+	return ret;
+}
+
+/* Reads block name as a string, cut at its first '\0'. Returns 0 on success */
+static int read_string(const struct cal_source *src, const char *name,
+		const unsigned long flags, char **value) {
+	void *data = NULL;
+	unsigned long len = 0;
+	if (source_read(src, name, &data, &len, flags) != 0) {
+		free(data);
+		*value = NULL;
+		return -1;
+	}
+	*value = malloc(len + 1);
+	if (*value == NULL) {
+		perror("Could not allocate block");
+		free(data);
+		return -1;
+	}
+	memcpy(*value, data, len);
+	(*value)[len] = '\0';
+	free(data);
+	return 0;
+}
+
+/* Prints KEY='value' line that shells can eval, NULL value printing as empty */
+static void print_variable(const char *key, const char *value) {
+	printf("%s='", key);
+	for (; value != NULL && *value; value++) {
+		if (*value == '\'') {
+			fputs("'\\''", stdout);
+		} else {
+			putchar(*value);
+		}
+	}
+	puts("'");
+}
+
+/* Prints block name as CAL_<NAME>, characters not valid in shell variables becoming _ */
+static void print_block_variable(const char *name, const char *value) {
+	char key[strlen("CAL_") + strlen(name) + 1];
+	char *out = key + strlen("CAL_");
+	memcpy(key, "CAL_", strlen("CAL_"));
+	for (; *name; name++) {
+		*out++ = isalnum((unsigned char)*name) ? toupper((unsigned char)*name) : '_';
+	}
+	*out = '\0';
+	print_variable(key, value);
+}
+
+/*
+ * Reads all requested values from one CAL handle and prints them as shell
+ * variables: RD_MODE, RD_FLAGS, ROOT_DEVICE, USB_HOST_MODE and CAL_<NAME>
+ * for each of blocks. Values missing from CAL are printed empty, RD_MODE
+ * as disabled, and make the query fail once everything is printed.
+ */
+static int query(const struct cal_source *src, const int rd_mode, const int rd_flags,
+		const int root_device, const int usb_host_mode,
+		const char **blocks, const int block_count) {
+	int ret = EXIT_SUCCESS;
+	char *value;
+	if (rd_mode || rd_flags) {
+		if (read_string(src, "r&d_mode", CAL_FLAG_USER, &value) != 0) {
+			ret = EXIT_FAILURE;
+		}
+		if (rd_mode) {
+			print_variable("RD_MODE", value != NULL && value[0] ? "enabled" : "disabled");
+		}
+		if (rd_flags) {
+			print_variable("RD_FLAGS", value);
+		}
+		free(value);
+	}
+	if (root_device) {
+		if (read_string(src, "root_device", CAL_FLAG_USER, &value) != 0) {
+			ret = EXIT_FAILURE;
+		}
+		print_variable("ROOT_DEVICE", value);
+		free(value);
+	}
+	if (usb_host_mode) {
+		if (read_string(src, "usb_host_mode", CAL_FLAG_USER, &value) != 0) {
+			ret = EXIT_FAILURE;
+		}
+		print_variable("USB_HOST_MODE", value);
+		free(value);
+	}
+	for (int i = 0; i < block_count; i++) {
+		if (read_string(src, blocks[i], 0, &value) != 0) {
+			ret = EXIT_FAILURE;
+		}
+		print_block_variable(blocks[i], value);
+		free(value);
+	}
+	return ret;
+}
+
+/* Block value to write */
+struct cal_write {
+	const char *name;
+	const char *value;
+	char *line; /* allocated NAME=VALUE the others point into, NULL if not ours */
+};
+
+/* Writes given one by one and from files, all done at once by write_blocks() */
+struct cal_writes {
+	struct cal_write *items;
+	size_t count;
+	size_t capacity;
+};
+
+static int writes_add(struct cal_writes *writes, const char *name, const char *value,
+		char *line) {
+	if (strlen(name) == 0 || strlen(name) > CAL_NAME_MAX) {
+		fprintf(stderr, "Invalid block name %s\n", name);
+		free(line);
+		return EXIT_FAILURE;
+	}
+	if (writes->count == writes->capacity) {
+		const size_t capacity = writes->capacity ? 2 * writes->capacity : 8;
+		struct cal_write *items = realloc(writes->items, capacity * sizeof(*items));
+		if (items == NULL) {
+			perror("Could not allocate writes");
+			free(line);
+			return EXIT_FAILURE;
+		}
+		writes->items = items;
+		writes->capacity = capacity;
+	}
+	struct cal_write *item = &writes->items[writes->count++];
+	item->name = name;
+	item->value = value;
+	item->line = line;
+	return EXIT_SUCCESS;
+}
+
+/* Adds write given as NAME=VALUE, splitting assignment in place */
+static int writes_add_assignment(struct cal_writes *writes, char *assignment, char *line) {
+	char *value = strchr(assignment, '=');
+	if (value == NULL) {
+		fprintf(stderr, "Expected name=value, got %s\n", assignment);
+		free(line);
+		return EXIT_FAILURE;
+	}
+	*value++ = '\0';
+	return writes_add(writes, assignment, value, line);
+}
+
+/* Adds NAME=VALUE lines of file at path, - for stdin, skipping empty and # lines */
+static int writes_read(struct cal_writes *writes, const char *path) {
+	FILE *in = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+	if (in == NULL) {
+		perror("Could not open file with writes");
+		return EXIT_FAILURE;
+	}
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	int ret = EXIT_SUCCESS;
+	while (ret == EXIT_SUCCESS && (len = getline(&line, &size, in)) != -1) {
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+			line[--len] = '\0';
+		}
+		if (len == 0 || line[0] == '#') {
+			continue;
+		}
+		char *copy = strdup(line);
+		ret = copy != NULL ? writes_add_assignment(writes, copy, copy) : EXIT_FAILURE;
+	}
+	free(line);
+	if (in != stdin) {
+		fclose(in);
+	}
+	return ret;
+}
+
+static void writes_free(struct cal_writes *writes) {
+	for (size_t i = 0; i < writes->count; i++) {
+		free(writes->items[i].line);
+	}
+	free(writes->items);
+}
+
+/*
+ * Writes blocks to user area of CAL, each block once with the last value
+ * given for it and only when that differs from what is stored, so flash
+ * is programmed once per changed block. Stops at the first failed write.
+ */
+static int write_blocks(const struct cal_source *src, const struct cal_writes *writes) {
+	for (size_t i = 0; i < writes->count; i++) {
+		const struct cal_write *item = &writes->items[i];
+		bool superseded = false;
+		for (size_t j = i + 1; j < writes->count && !superseded; j++) {
+			superseded = strcmp(writes->items[j].name, item->name) == 0;
+		}
+		void *data = NULL;
+		unsigned long len = 0;
+		const size_t value_len = strlen(item->value);
+		const bool same = !superseded &&
+			source_read(src, item->name, &data, &len, CAL_FLAG_USER) == 0 &&
+			len == value_len && memcmp(data, item->value, len) == 0;
+		free(data);
+		if (superseded || same) {
+			continue;
+		}
+		const uint64_t start = trace_now();
+		if (cal_write_block(src->cal, item->name, item->value, value_len,
+				CAL_FLAG_USER) != 0) {
+			trace_error("write", item->name, "failed", start);
+			fprintf(stderr, "Could not write block %s\n", item->name);
+			return EXIT_FAILURE;
+		}
+		trace_end("write", item->name, start);
+	}
+	return EXIT_SUCCESS;
+}
 
 int main(const int argc, const char **argv) {
 	int version = 0;
@@ -33,8 +603,12 @@ int main(const int argc, const char **argv) {
 	int rd_flags = 0;
 	int get_root_device = 0;
 	int usb_host_mode = 0;
+	int batch_query = 0;
 	char *get_value = NULL;
 	char *root_device = NULL;
+	char *image = NULL;
+	char *set_value = NULL;
+	char *set_file = NULL;
 	const struct poptOption options[] = {
 		{"get-rd-mode", 'd', POPT_ARG_NONE, &rd_mode, 0, "Get R&D mode status", NULL},
 		{"get-rd-flags", 'f', POPT_ARG_NONE, &rd_flags, 0, "Get R&D mode flags", NULL},
@@ -42,10 +616,22 @@ int main(const int argc, const char **argv) {
 			"Get root device", NULL},
 		{"set-root-device", 'R', POPT_ARG_STRING, &root_device, 0,
 			"Set root device", NULL},
-		{"get-block", 'G', POPT_ARG_STRING, &get_value, 0,
+		{"get-block", 'G', POPT_ARG_STRING, &get_value, 'G',
 			"Print block data to stdout", NULL},
+		{"set", 's', POPT_ARG_STRING, &set_value, 's',
+			"Set block in user area, repeatable. Only changed blocks are"
+			" written, each once", "<name>=<value>"},
+		{"set-from", 0, POPT_ARG_STRING, &set_file, 0,
+			"Set blocks listed in file as name=value lines, - for stdin. Blocks"
+			" set by other options may not be listed", "<file>"},
 		{"get-usb-host-mode", 'u', POPT_ARG_NONE, &usb_host_mode, 0,
 			"Get USB host mode flag", NULL},
+		{"query", 'q', POPT_ARG_NONE, &batch_query, 0,
+			"Do all get options given, -G ones repeatable, on one CAL scan and"
+			" print results as shell variables", NULL},
+		{"image", 'i', POPT_ARG_STRING, &image, 0,
+			"Experimental: read -G blocks natively from partition image or mtd"
+			" device instead of through libcal", "<file>"},
 		{"version", 0, POPT_ARG_NONE, &version, 0, "Output version", NULL},
 		POPT_TABLEEND
 	};
@@ -54,22 +640,71 @@ int main(const int argc, const char **argv) {
 		POPT_AUTOHELP
 		POPT_TABLEEND
 	};
+	trace_init("cal-tool");
 	poptContext ctx = poptGetContext(NULL, argc, argv, popts, POPT_CONTEXT_NO_EXEC);
 	poptSetOtherOptionHelp(ctx, "OPTION");
-	const int rc = poptGetNextOpt(ctx);
-	const int option_sum = version + rd_mode + rd_flags + get_root_device
-		+ usb_host_mode + (root_device == NULL ? 0 : 1)
-		+ (get_value == NULL ? 0 : 1);
+	const char *blocks[argc];
+	int block_count = 0;
+	struct cal_writes writes = {NULL, 0, 0};
+	bool writes_ok = true;
+	int rc;
+	while ((rc = poptGetNextOpt(ctx)) == 'G' || rc == 's') {
+		if (rc == 'G') {
+			blocks[block_count++] = get_value;
+		} else if (writes_add_assignment(&writes, set_value, NULL) != EXIT_SUCCESS) {
+			writes_ok = false;
+		}
+	}
+	/* added after --set ones, so it wins over --set root_device */
+	if (rc == -1 && root_device != NULL &&
+			writes_add(&writes, "root_device", root_device, NULL) != EXIT_SUCCESS) {
+		writes_ok = false;
+	}
+	const size_t option_writes = writes.count;
+	if (rc == -1 && writes_ok && set_file != NULL &&
+			writes_read(&writes, set_file) != EXIT_SUCCESS) {
+		writes_ok = false;
+	}
+	/* neither source is more explicit than the other, so they may not overlap */
+	for (size_t i = option_writes; writes_ok && i < writes.count; i++) {
+		for (size_t j = 0; writes_ok && j < option_writes; j++) {
+			if (strcmp(writes.items[i].name, writes.items[j].name) == 0) {
+				fprintf(stderr, "Block %s is set both by option and in %s\n",
+					writes.items[i].name, set_file);
+				writes_ok = false;
+			}
+		}
+	}
+	const int get_sum = rd_mode + rd_flags + get_root_device + usb_host_mode + block_count;
+	const bool set = writes.count > 0 || set_file != NULL;
+	const int option_sum = version + get_sum + (set ? 1 : 0);
 
-	struct cal * c;
+	struct cal_source src;
 	int ret = EXIT_FAILURE;
 	if (rc != -1) {
 		/* Invalid option */
 		fprintf(stderr, "%s: %s\n",
 			poptBadOption(ctx, POPT_BADOPTION_NOALIAS),
 			poptStrerror(rc));
+	} else if (!writes_ok) {
+		/* reported already */
+	} else if (batch_query && option_sum != get_sum) {
+		fputs("Only get options can be given with --query\n", stderr);
+	} else if (batch_query && get_sum == 0) {
+		fputs("Nothing to query\n", stderr);
+	} else if (image != NULL && set) {
+		fputs("CAL image is read only, writing needs libcal\n", stderr);
+	} else if (image != NULL && rd_mode + rd_flags + get_root_device + usb_host_mode > 0) {
+		fputs("User area blocks can't be read from a CAL image yet, they need libcal\n",
+			stderr);
+	} else if (batch_query) {
+		if (source_open(&src, image) == 0) {
+			ret = query(&src, rd_mode, rd_flags, get_root_device, usb_host_mode,
+				blocks, block_count);
+			source_close(&src);
+		}
 	} else if (option_sum > 1) {
-		fputs("Only one option can be given\n", stderr);
+		fputs("Only one option can be given, or any number of set ones\n", stderr);
 	} else if (option_sum == 0) {
 		/* No action given */
 		poptPrintHelp(ctx, stdout, 0);
@@ -82,42 +717,48 @@ int main(const int argc, const char **argv) {
 				"This is free software: you are free to change and redistribute it.\n"
 				"There is NO WARRANTY, to the extent permitted by law.");
 		ret = EXIT_SUCCESS;
-	} else if (cal_init(&c) == 0) {
+	} else if (set) {
+		if (source_open(&src, NULL) == 0) {
+			ret = write_blocks(&src, &writes);
+			source_close(&src);
+		}
+	} else if (source_open(&src, image) == 0) {
 		void *data = NULL;
 		unsigned long len = 0;
 		if (rd_mode) {
-			ret = cal_read_block(c, "r&d_mode", &data, &len, CAL_FLAG_USER);
+			ret = source_read(&src, "r&d_mode", &data, &len, CAL_FLAG_USER);
 			ret = (ret == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
 			puts((ret == 0 && len >= 1 && ((char *)data)[0]) ? "enabled" : "disabled");
-		} else if (rd_flags && !cal_read_block(c, "r&d_mode", &data, &len, CAL_FLAG_USER)) {
+		} else if (rd_flags && !source_read(&src, "r&d_mode", &data, &len, CAL_FLAG_USER)) {
 			char buf[len + 1];
 			memcpy(buf, data, len);
 			buf[len] = '\0';
 			if (buf[0])
 				puts(buf);
 			ret = EXIT_SUCCESS;
-		} else if (get_root_device && !cal_read_block(c, "root_device", &data, &len, CAL_FLAG_USER)) {
+		} else if (get_root_device && !source_read(&src, "root_device", &data, &len, CAL_FLAG_USER)) {
 			char buf[len + 1];
 			memcpy(buf, data, len);
 			buf[len] = '\0';
 			if (buf[0])
 				puts(buf);
 			ret = EXIT_SUCCESS;
-		} else if (root_device && !cal_write_block(c, "root_device", root_device, strlen(root_device), CAL_FLAG_USER)) {
-			ret = EXIT_SUCCESS;
-		} else if (usb_host_mode && !cal_read_block(c, "usb_host_mode", &data, &len, CAL_FLAG_USER)) {
+		} else if (usb_host_mode && !source_read(&src, "usb_host_mode", &data, &len, CAL_FLAG_USER)) {
 			char buf[len + 1];
 			memcpy(buf, data, len);
 			buf[len] = '\0';
 			if (buf[0])
 				puts(buf);
 			ret = EXIT_SUCCESS;
-		} else if (get_value && !cal_read_block(c, get_value, &data, &len, 0)) {
-			ret = fwrite(data, 1, len, stdout) == len;
+		} else if (get_value && !source_read(&src, get_value, &data, &len, 0)) {
+			/* flushed here, so a full disk or closed pipe fails too */
+			ret = fwrite(data, 1, len, stdout) == len && fflush(stdout) == 0 ?
+				EXIT_SUCCESS : EXIT_FAILURE;
 		}
 		free(data);
-		cal_finish(c);
+		source_close(&src);
 	}
+	writes_free(&writes);
 	poptFreeContext(ctx);
 	return ret;
 }
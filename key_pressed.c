@@ -17,54 +17,282 @@
 
 */
 
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
-#include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <termios.h>
+#include <linux/input.h>
+
+#include "trace.h"
+
+#ifdef MULTICALL
+#include "multicall.h"
+#define main key_pressed_main
+#endif
+
+#define MAX_DEVICES 32
+#define MAX_KEYS 32
+#define INPUT_DIR "/dev/input"
+
+/* Key codes to wait for, any key when count is 0 */
+struct key_filter {
+	unsigned int codes[MAX_KEYS];
+	int count;
+};
+
+static bool key_matches(const struct key_filter *filter, const unsigned int code) {
+	for (int i = 0; i < filter->count; i++) {
+		if (filter->codes[i] == code)
+			return true;
+	}
+	return filter->count == 0;
+}
+
+/*
+ * Parses timeout in seconds, fractions allowed, or in milliseconds with
+ * ms suffix. Returns milliseconds or -1.
+ */
+static long parse_timeout(const char *str) {
+	char *end;
+	const double value = strtod(str, &end);
+	if (end == str || value < 0)
+		return -1;
+	if (strcmp(end, "ms") == 0)
+		return (long)value;
+	if (*end != '\0')
+		return -1;
+	return (long)(value * 1000 + 0.5);
+}
+
+/*
+ * Opens event device for waiting. Returns its fd, or -1, and stores the
+ * first matching key already held down in *held, which stays -1 if none.
+ */
+static int open_device(const char *path, const struct key_filter *filter, int *held) {
+	unsigned char keys[KEY_MAX / 8 + 1];
+	const int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+	memset(keys, 0, sizeof(keys));
+	if (ioctl(fd, EVIOCGKEY(sizeof(keys)), keys) >= 0) {
+		for (unsigned int code = 0; code <= KEY_MAX && *held < 0; code++) {
+			if (keys[code / 8] >> code % 8 & 1 && key_matches(filter, code))
+				*held = code;
+		}
+	}
+	return fd;
+}
+
+/* Adds all event devices in INPUT_DIR to fds, returns new count */
+static int open_all_devices(int *fds, int count, const struct key_filter *filter, int *held) {
+	DIR *dir = opendir(INPUT_DIR);
+	struct dirent *entry;
+	if (dir == NULL) {
+		perror(INPUT_DIR);
+		return count;
+	}
+	while (count < MAX_DEVICES && (entry = readdir(dir)) != NULL) {
+		char path[sizeof(INPUT_DIR) + sizeof(entry->d_name) + 1];
+		if (strncmp(entry->d_name, "event", 5) != 0)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", INPUT_DIR, entry->d_name);
+		const int fd = open_device(path, filter, held);
+		if (fd >= 0)
+			fds[count++] = fd;
+	}
+	closedir(dir);
+	return count;
+}
+
+/*
+ * Reads pending events of device fd. Returns code of first matching key
+ * press or autorepeat, -1 if there is none or -2 if device went away.
+ */
+static int read_key(const int fd, const struct key_filter *filter) {
+	struct input_event events[64];
+	ssize_t len;
+	while ((len = read(fd, events, sizeof(events))) > 0) {
+		for (size_t i = 0; i < len / sizeof(events[0]); i++) {
+			if (events[i].type == EV_KEY && events[i].value != 0 &&
+					key_matches(filter, events[i].code))
+				return events[i].code;
+		}
+	}
+	return len == 0 || errno != EAGAIN ? -2 : -1;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-a] [-d DEVICE]... [-k CODE]... [-n] [-r] TIME\n" \
+		"\treturn 1, if any key is pressed within the given time\n" \
+		"\treturn 0, if timeout occurs and no key is pressed\n" \
+		"\tTIME is in seconds, fractions allowed, or in ms with ms suffix\n" \
+		"\t-a\twatch all " INPUT_DIR "/event* devices\n" \
+		"\t-d\twatch this input event device\n" \
+		"\t-k\tonly count this key code of event devices, e.g. 28 for enter\n" \
+		"\t-n\tdon't watch terminal on stdin\n" \
+		"\t-r\tprint code of pressed key, or tty for terminal, to stdout\n", name);
+}
 
 int main(int argc, char * argv[]) {
 
-	fd_set rfds;
 	char buf[1024];
 	struct termios termios_save;
 	struct termios termios_p;
-	struct timeval tv;
-	int timeout = -1;
-	int ret;
+	struct key_filter filter;
+	const char *paths[MAX_DEVICES];
+	int fds[MAX_DEVICES];
+	int path_count = 0;
+	int count = 0;
+	int held = -1;
+	bool all = false;
+	bool tty = true;
+	bool restore = false;
+	bool ready = false;
+	bool report = false;
+	long timeout = -1;
+	int ret = -1;
+	int opt;
+
+	filter.count = 0;
+	trace_init("key_pressed");
+	uint64_t start = trace_now();
+	while ( (opt = getopt(argc, argv, "ad:k:nr")) != -1 ) {
+		switch (opt) {
+		case 'a':
+			all = true;
+			break;
+		case 'd':
+			if ( path_count < MAX_DEVICES )
+				paths[path_count++] = optarg;
+			break;
+		case 'k':
+			if ( filter.count < MAX_KEYS )
+				filter.codes[filter.count++] = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			tty = false;
+			break;
+		case 'r':
+			report = true;
+			break;
+		default:
+			timeout = -2;
+			break;
+		}
+	}
 
-	if ( argc == 2 )
-		timeout = strtol(argv[1], NULL, 10);
+	if ( timeout == -1 && optind == argc - 1 )
+		timeout = parse_timeout(argv[optind]);
 
 	if ( timeout < 0 ) {
-		fprintf(stderr, "Usage: %s TIME\n" \
-			"\treturn 1, if any key is pressed within the given time\n" \
-			"\treturn 0, if timeout occurs and no key is pressed\n", argv[0]);
+		usage(argv[0]);
 		return -1;
 	}
+	for ( int i = 0; i < path_count; i++ ) {
+		if ( (fds[count] = open_device(paths[i], &filter, &held)) >= 0 )
+			++count;
+	}
+	if ( all )
+		count = open_all_devices(fds, count, &filter, &held);
+	trace_end("open", NULL, start);
 
-	tcgetattr(0, &termios_save);
-
-	memcpy(&termios_p, &termios_save, sizeof(struct termios));
-	termios_p.c_lflag &= ~ECHO;
-	termios_p.c_lflag &= ~ICANON;
-	tcsetattr(0, 0, &termios_p);
-
-	FD_ZERO(&rfds);
-	FD_SET(0, &rfds);
-
-	tv.tv_sec = timeout;
-	tv.tv_usec = 0;
+	start = trace_now();
+	if ( tty && tcgetattr(0, &termios_save) == 0 ) {
+		memcpy(&termios_p, &termios_save, sizeof(struct termios));
+		termios_p.c_lflag &= ~ECHO;
+		termios_p.c_lflag &= ~ICANON;
+		restore = tcsetattr(0, 0, &termios_p) == 0;
+	} else if ( tty && count > 0 ) {
+		/* not a terminal, input devices are what counts */
+		tty = false;
+	}
+	trace_end("termios", NULL, start);
 
-	ret = select(1, &rfds, NULL, NULL, &tv);
+	start = trace_now();
+	const int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	const int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	struct epoll_event event;
+	struct itimerspec timer;
+	memset(&event, 0, sizeof(event));
+	memset(&timer, 0, sizeof(timer));
+	timer.it_value.tv_sec = timeout / 1000;
+	timer.it_value.tv_nsec = timeout % 1000 * 1000000;
+	event.events = EPOLLIN;
+	/* events carry device index, count for tty and count + 1 for timer */
+	for ( int i = 0; i < count; i++ ) {
+		event.data.u32 = i;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fds[i], &event);
+	}
+	event.data.u32 = count;
+	if ( tty && epoll_fd >= 0 && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, 0, &event) != 0 ) {
+		/* regular files and /dev/null can't be polled, but always have input */
+		if ( errno == EPERM )
+			ready = true;
+		else
+			perror("Could not watch stdin");
+		tty = false;
+	}
+	event.data.u32 = count + 1;
+	if ( epoll_fd < 0 || timer_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &event) != 0 ) {
+		perror("Could not set up waiting");
+	} else if ( held >= 0 || ready ) {
+		ret = 1;
+	} else if ( timeout > 0 && timerfd_settime(timer_fd, 0, &timer, NULL) != 0 ) {
+		perror("Could not set timer");
+	} else {
+		ret = 0;
+		/* a timer armed with 0 would never fire, so just poll */
+		while ( ret == 0 ) {
+			const int n = epoll_wait(epoll_fd, &event, 1, timeout > 0 ? -1 : 0);
+			if ( n < 0 && errno == EINTR )
+				continue;
+			if ( n < 0 ) {
+				perror("Could not wait");
+				ret = -1;
+			} else if ( n == 0 || event.data.u32 == (uint32_t)count + 1 ) {
+				break;
+			} else if ( event.data.u32 == (uint32_t)count ) {
+				if ( read(0, buf, sizeof(buf)) > 0 ) {
+					ret = 1;
+				} else {
+					/* end of input, no key will come from there */
+					epoll_ctl(epoll_fd, EPOLL_CTL_DEL, 0, NULL);
+					tty = false;
+				}
+			} else if ( (held = read_key(fds[event.data.u32], &filter)) >= 0 ) {
+				ret = 1;
+			} else if ( held == -2 ) {
+				epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fds[event.data.u32], NULL);
+			}
+		}
+	}
+	if ( ret >= 0 )
+		trace_end("wait", ret == 1 ? "key" : "timeout", start);
+	else
+		trace_error("wait", NULL, "failed", start);
 
-	if (ret == 1 && FD_ISSET(0, &rfds))
-		read(0, buf, sizeof(buf));
+	if ( report && ret == 1 ) {
+		if ( held >= 0 )
+			printf("%d\n", held);
+		else
+			puts("tty");
+	}
 
-	tcsetattr(0, 0, &termios_save);
+	start = trace_now();
+	if ( restore )
+		tcsetattr(0, 0, &termios_save);
+	trace_end("termios", "restore", start);
 	return ret;
 
 }
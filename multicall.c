@@ -0,0 +1,50 @@
+/*
+	multicall.c - text2screen, cal-tool and key_pressed in one binary
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "multicall.h"
+
+/*
+ * Runs the tool named by the last component of argv[0], so the binary can
+ * be installed once and linked to under each tool's name. Called by its
+ * own name, it runs the tool named by the first argument instead.
+ */
+int main(int argc, char *argv[]) {
+	const char *name = strrchr(argv[0], '/');
+	name = name != NULL ? name + 1 : argv[0];
+	if (strcmp(name, "initrd-progs") == 0 && argc > 1) {
+		--argc;
+		++argv;
+		name = argv[0];
+	}
+	/* popt takes argv of const strings */
+	const char **const_argv = (void *)argv;
+	if (strcmp(name, "text2screen") == 0) {
+		return text2screen_main(argc, const_argv);
+	} else if (strcmp(name, "cal-tool") == 0) {
+		return cal_tool_main(argc, const_argv);
+	} else if (strcmp(name, "key_pressed") == 0) {
+		return key_pressed_main(argc, argv);
+	}
+	fprintf(stderr, "Usage: initrd-progs TOOL [ARGS]...\n"
+		"Tools: text2screen, cal-tool, key_pressed\n"
+		"Links to initrd-progs named after a tool run that tool.\n");
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,30 @@
+/*
+	multicall.h - entry points of tools built into one binary
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Built with MULTICALL defined, each tool's main() is renamed to the entry
+ * point below and multicall.c picks one by the name it is called as.
+ */
+
+#ifndef MULTICALL_H
+#define MULTICALL_H
+
+int text2screen_main(int argc, const char *argv[]);
+int cal_tool_main(const int argc, const char **argv);
+int key_pressed_main(int argc, char * argv[]);
+
+#endif
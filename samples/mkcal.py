@@ -0,0 +1,42 @@
+#!/usr/bin/env python3
+# Writes cal.img, a synthesized CAL partition image for cal-tool --image.
+# It is not a device dump: it holds blocks in the layout cal-tool.c
+# describes, with the cases its reader has to get right.
+import struct
+import zlib
+
+image = bytearray()
+
+
+def block(name, data, version, corrupt=None):
+    global image
+    while len(image) % 4:
+        image.append(0xff)
+    header = b'ConF' + struct.pack('<BBH16sII', 2, 0, version, name.encode(),
+                                   len(data), zlib.crc32(data))
+    header += struct.pack('<I', zlib.crc32(header))
+    if corrupt == 'data':
+        data = bytes([data[0] ^ 1]) + data[1:]
+    elif corrupt == 'header':
+        header = header[:8] + b'X' + header[9:]
+    image += header + data
+
+
+block('root_device', b'old', 1)
+block('r&d_mode', b'no-omap-wd,no-lifeguard-reset', 3)
+block('root_device', b'mmc', 2)
+block('r&d_mode', b'stale', 2)
+block('usb_host_mode', b'1', 5, corrupt='data')
+block('usb_host_mode', b'0', 4)
+block('root_device', b'flash', 9, corrupt='header')
+image += b'\xff' * 100
+block('lock_code', b'12345', 1)
+block('sixteen_chars_nm', b'name of 16 chars', 1)
+block('tie', b'first', 1)
+block('tie', b'second', 1)
+image += b'junk' * 3
+block('quote', b"it's", 1)
+image += b'\xff' * (4096 - len(image))
+
+with open('cal.img', 'wb') as out:
+    out.write(image)
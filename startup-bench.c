@@ -0,0 +1,211 @@
+/*
+	This file is part of initrd-progs.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Startup latency benchmark. Times exec to exit of short tool runs, once
+ * for the separate binaries and once for the initrd-progs multicall
+ * binary called under each tool's name.
+ */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <popt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Most arguments of a run, with argv[0] and the terminating NULL */
+#define ARGS_MAX 8
+
+/* Tool run, argv[0] naming the tool */
+struct bench_case {
+	const char *name;
+	const char *argv[ARGS_MAX];
+};
+
+static const struct bench_case cases[] = {
+	{"version", {"text2screen", "--version", NULL}},
+	{"draw", {"text2screen", "-t", "Booting...", "fake:64x64x16", NULL}},
+	{"version", {"cal-tool", "--version", NULL}},
+	{"poll", {"key_pressed", "-n", "0", NULL}},
+};
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Seconds a run may take before it counts as hung */
+#define RUN_TIMEOUT 10
+
+/*
+ * Runs path as argv with stdio on /dev/null, returns its exit status or -1,
+ * also when it was killed for taking longer than RUN_TIMEOUT
+ */
+static int run(const char *path, const char *const argv[ARGS_MAX]) {
+	const pid_t pid = fork();
+	if (pid == 0) {
+		/* execv() doesn't modify argv, it is only declared without const */
+		char *args[ARGS_MAX];
+		memcpy(args, argv, sizeof(args));
+		const int null = open("/dev/null", O_RDWR);
+		dup2(null, STDIN_FILENO);
+		dup2(null, STDOUT_FILENO);
+		dup2(null, STDERR_FILENO);
+		/* survives exec, so a hung tool is killed */
+		alarm(RUN_TIMEOUT);
+		execv(path, args);
+		_exit(127);
+	}
+	int status;
+	if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status)) {
+		return -1;
+	}
+	return WEXITSTATUS(status);
+}
+
+/* Times iterations runs of case c with binary at path */
+static int bench_run(const char *kind, const char *path, const struct bench_case *c,
+		const int iterations) {
+	if (access(path, X_OK) != 0) {
+		printf("%-9s %-11s %-7s: missing %s\n", kind, c->argv[0], c->name, path);
+		return EXIT_SUCCESS;
+	}
+	double best = 0;
+	double total = 0;
+	for (int i = 0; i < iterations; i++) {
+		const double start = now();
+		const int status = run(path, c->argv);
+		const double elapsed = now() - start;
+		if (status < 0 || status == 127) {
+			fprintf(stderr, "Could not run %s\n", path);
+			return EXIT_FAILURE;
+		}
+		best = i == 0 || elapsed < best ? elapsed : best;
+		total += elapsed;
+	}
+	printf("%-9s %-11s %-7s: mean %.0f us, best %.0f us\n", kind, c->argv[0], c->name,
+		total / iterations * 1e6, best * 1e6);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Times round trips of a clear big enough for the worker pool sent to a
+ * text2screen daemon drawing on 4 threads, so a daemon left without
+ * workers fails by timeout instead of hanging the benchmark
+ */
+static int bench_daemon(const char *kind, const char *path, const int iterations) {
+	if (access(path, X_OK) != 0) {
+		printf("%-9s %-11s %-7s: missing %s\n", kind, "text2screen", "daemon", path);
+		return EXIT_SUCCESS;
+	}
+	const char *dir = getenv("TMPDIR");
+	char socket_path[PATH_MAX];
+	snprintf(socket_path, sizeof(socket_path), "%s/startup-bench-%ld.sock",
+		dir != NULL ? dir : "/tmp", (long)getpid());
+	const char *start[ARGS_MAX] = {"text2screen", "--daemon", "-j", "4", "-S", socket_path,
+		"fake:800x480x32", NULL};
+	const char *clear[ARGS_MAX] = {"text2screen", "-S", socket_path, "--send", "-c", NULL};
+	const char *quit[ARGS_MAX] = {"text2screen", "-S", socket_path, "--send", "--quit", NULL};
+	if (run(path, start) != 0) {
+		fprintf(stderr, "Could not start daemon %s\n", path);
+		return EXIT_FAILURE;
+	}
+	int ret = EXIT_SUCCESS;
+	double best = 0;
+	double total = 0;
+	for (int i = 0; ret == EXIT_SUCCESS && i < iterations; i++) {
+		const double begin = now();
+		if (run(path, clear) != 0) {
+			fprintf(stderr, "Daemon of %s did not clear in %d s\n", path, RUN_TIMEOUT);
+			ret = EXIT_FAILURE;
+		}
+		const double elapsed = now() - begin;
+		best = i == 0 || elapsed < best ? elapsed : best;
+		total += elapsed;
+	}
+	if (run(path, quit) != 0) {
+		fprintf(stderr, "Could not stop daemon of %s\n", path);
+		unlink(socket_path);
+		ret = EXIT_FAILURE;
+	}
+	if (ret == EXIT_SUCCESS) {
+		printf("%-9s %-11s %-7s: mean %.0f us, best %.0f us\n", kind, "text2screen",
+			"daemon", total / iterations * 1e6, best * 1e6);
+	}
+	return ret;
+}
+
+int main(int argc, const char *argv[]) {
+	int iterations = 100;
+	char *dir = NULL;
+	char *multicall = NULL;
+	const struct poptOption options[] = {
+		{"iterations", 'i', POPT_ARG_INT, &iterations, 0,
+			"Repeat each run. Default is 100", "<int>"},
+		{"dir", 'd', POPT_ARG_STRING, &dir, 0,
+			"Directory with separate binaries. Default is this program's", "<dir>"},
+		{"multicall", 'm', POPT_ARG_STRING, &multicall, 0,
+			"Multicall binary. Default is initrd-progs in that directory", "<file>"},
+		POPT_TABLEEND
+	};
+	const struct poptOption popts[] = {
+		{NULL, 0, POPT_ARG_INCLUDE_TABLE, &options, 0, "Options:", NULL},
+		POPT_AUTOHELP
+		POPT_TABLEEND
+	};
+	poptContext ctx = poptGetContext(NULL, argc, argv, popts, POPT_CONTEXT_NO_EXEC);
+	const int rc = poptGetNextOpt(ctx);
+	int ret = EXIT_SUCCESS;
+	if (rc != -1) {
+		fprintf(stderr, "%s: %s\n",
+			poptBadOption(ctx, POPT_BADOPTION_NOALIAS),
+			poptStrerror(rc));
+		ret = EXIT_FAILURE;
+	} else if (iterations <= 0 || poptPeekArg(ctx) != NULL) {
+		poptPrintHelp(ctx, stderr, 0);
+		ret = EXIT_FAILURE;
+	} else {
+		char own_dir[PATH_MAX] = ".";
+		const char *slash = strrchr(argv[0], '/');
+		if (dir == NULL && slash != NULL && slash - argv[0] < PATH_MAX) {
+			memcpy(own_dir, argv[0], slash - argv[0]);
+			own_dir[slash - argv[0]] = '\0';
+		}
+		const char *bin_dir = dir != NULL ? dir : own_dir;
+		char multicall_path[PATH_MAX + 16];
+		snprintf(multicall_path, sizeof(multicall_path), "%s/initrd-progs", bin_dir);
+		for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+			char path[PATH_MAX + 16];
+			snprintf(path, sizeof(path), "%s/%s", bin_dir, cases[i].argv[0]);
+			ret |= bench_run("separate", path, &cases[i], iterations);
+			ret |= bench_run("multicall", multicall != NULL ? multicall : multicall_path,
+				&cases[i], iterations);
+		}
+		char path[PATH_MAX + 16];
+		snprintf(path, sizeof(path), "%s/text2screen", bin_dir);
+		ret |= bench_daemon("separate", path, iterations);
+		ret |= bench_daemon("multicall", multicall != NULL ? multicall : multicall_path,
+			iterations);
+	}
+	poptFreeContext(ctx);
+	return ret;
+}
@@ -0,0 +1,713 @@
+/*
+	This file is part of fb_text2screen.
+
+	fb_text2screen is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	fb_text2screen is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fb_text2screen.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Renderer benchmark. Builds text2screen.c without its main() and drives
+ * the drawing functions against fake framebuffers in memory or, for
+ * presentation timings, against a real device.
+ */
+
+#pragma GCC diagnostic ignored "-Wunused-function"
+#define TEXT2SCREEN_NO_MAIN
+#include "text2screen.c"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <time.h>
+
+static const char status_text[] = "Booting kernel from internal eMMC...";
+
+static const char *present_names[] = {"direct", "copy", "flip"};
+
+static const unsigned int bpps[] = {8, 16, 24, 32};
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Opens fake framebuffer of given geometry, stride 0 meaning packed lines */
+static int bench_fb_init(struct fb *fb, const int width, const int height,
+		const unsigned int bpp, const unsigned int stride,
+		const enum fb_present present, const int threads) {
+	char device[64];
+	snprintf(device, sizeof(device), "fake:%dx%dx%u,pages=2,stride=%u",
+		width, height, bpp, stride ? stride : width * bpp / 8);
+	memset(fb, 0, sizeof(*fb));
+	fb->device = device;
+	fb->present = present;
+	fb->threads = threads;
+	const int ret = fb_init(fb);
+	fb->device = "fake";
+	return ret;
+}
+
+/* Full-screen clears, alternating colors so no pass can be skipped */
+static int bench_clear(const int width, const int height, const unsigned int bpp,
+		const unsigned int stride, const int iterations) {
+	struct fb fb;
+	if (bench_fb_init(&fb, width, height, bpp, stride, FB_PRESENT_DIRECT, 1) != EXIT_SUCCESS) {
+		return EXIT_FAILURE;
+	}
+	const double start = now();
+	for (int i = 0; i < iterations; i++) {
+		fb_clear(&fb, (i & 1) ? 0x4e02 : 0x123456, 0, 0, 0, 0);
+	}
+	const double elapsed = now() - start;
+	const double pixels = (double)width * height * iterations;
+	printf("clear %dx%d %ubpp stride %u: %.1f MPixel/s, %.1f MB/s\n",
+		width, height, bpp, fb.line_len,
+		pixels / elapsed / 1e6, pixels * fb.depth / elapsed / 1e6);
+	fb_destroy(&fb);
+	return EXIT_SUCCESS;
+}
+
+/* Status line text at given scale and font, with and without background */
+static int bench_text(const unsigned int bpp, const int scale, const bool bg_clear,
+		const char *font, const int iterations) {
+	struct fb fb;
+	if (bench_fb_init(&fb, 800, 480, bpp, 0, FB_PRESENT_DIRECT, 1) != EXIT_SUCCESS) {
+		return EXIT_FAILURE;
+	}
+	if (fb_set_font(&fb, font) != EXIT_SUCCESS) {
+		fb_destroy(&fb);
+		return EXIT_FAILURE;
+	}
+	/* no more characters than fit one line at this scale */
+	char text[sizeof(status_text)];
+	size_t len = (size_t)fb.width / (fb_font(&fb)->width * scale);
+	len = len < sizeof(text) - 1 ? len : sizeof(text) - 1;
+	memcpy(text, status_text, len);
+	text[len] = '\0';
+	const double start = now();
+	for (int i = 0; i < iterations; i++) {
+		if (fb_write_text(&fb, text, scale, bg_clear, 0xffffff,
+				(i & 1) ? 0x4e02 : 0x123456, 0, 0, NULL, NULL) != EXIT_SUCCESS) {
+			fb_destroy(&fb);
+			return EXIT_FAILURE;
+		}
+	}
+	const double elapsed = now() - start;
+	printf("text %ubpp %dx%d font scale %d %s: %.1f us per %u chars\n",
+		bpp, fb_font(&fb)->width, fb_font(&fb)->height, scale,
+		bg_clear ? "opaque" : "transparent", elapsed / iterations * 1e6, (unsigned int)len);
+	fb_destroy(&fb);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Status screen of 20 lines rewritten whole, once with nothing changed
+ * and once with a counter changed in one line, as scripts redraw it.
+ */
+static int bench_status(const unsigned int bpp, const int iterations) {
+	struct fb fb;
+	if (bench_fb_init(&fb, 800, 480, bpp, 0, FB_PRESENT_DIRECT, 1) != EXIT_SUCCESS) {
+		return EXIT_FAILURE;
+	}
+	double elapsed[2];
+	for (int changing = 0; changing < 2; changing++) {
+		const double start = now();
+		for (int i = 0; i < iterations; i++) {
+			for (int line = 0; line < 20; line++) {
+				char text[64];
+				snprintf(text, sizeof(text), "%s %d", status_text,
+					changing && line == 10 ? i : line);
+				if (fb_write_text(&fb, text, 2, true, 0xffffff, 0x4e02,
+						0, line * 20, NULL, NULL) != EXIT_SUCCESS) {
+					fb_destroy(&fb);
+					return EXIT_FAILURE;
+				}
+			}
+			fb_flush(&fb);
+		}
+		elapsed[changing] = now() - start;
+	}
+	printf("status %ubpp 20 lines: unchanged %.1f us, one line changed %.1f us\n",
+		bpp, elapsed[0] / iterations * 1e6, elapsed[1] / iterations * 1e6);
+	fb_destroy(&fb);
+	return EXIT_SUCCESS;
+}
+
+/* Translucent 400x120 message box with a line of text, blended over the screen */
+static int bench_overlay(const unsigned int bpp, const int iterations) {
+	struct fb fb;
+	if (bench_fb_init(&fb, 800, 480, bpp, 0, FB_PRESENT_DIRECT, 1) != EXIT_SUCCESS) {
+		return EXIT_FAILURE;
+	}
+	fb_clear(&fb, 0x4e02, 0, 0, 0, 0);
+	const double start = now();
+	for (int i = 0; i < iterations; i++) {
+		if (fb_clear(&fb, 0x80000000, 200, 180, 400, 120) != EXIT_SUCCESS ||
+				fb_write_text(&fb, status_text, 1, true, 0x40ffffff,
+					(i & 1) ? 0xc0ffff00 : 0xc000ffff, 256, 236, NULL, NULL) != EXIT_SUCCESS) {
+			fb_destroy(&fb);
+			return EXIT_FAILURE;
+		}
+		fb_flush(&fb);
+	}
+	const double elapsed = now() - start;
+	printf("overlay %ubpp 400x120 box and text: %.1f us\n", bpp, elapsed / iterations * 1e6);
+	fb_destroy(&fb);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * 800x480 screen turned by rotate: one status line changed per frame and
+ * a full clear, each flushed, so portrait can be compared to landscape.
+ */
+static int bench_rotate(const unsigned int bpp, const int rotate, const int iterations) {
+	char device[64];
+	snprintf(device, sizeof(device), "fake:800x480x%u", bpp);
+	struct fb fb = {.device = device, .rotate = rotate, .threads = 1};
+	if (fb_init(&fb) != EXIT_SUCCESS) {
+		return EXIT_FAILURE;
+	}
+	fb.device = "fake";
+	double elapsed[2];
+	double start = now();
+	for (int i = 0; i < iterations; i++) {
+		char text[64];
+		snprintf(text, sizeof(text), "%s %d", status_text, i);
+		if (fb_write_text(&fb, text, 2, true, 0xffffff, 0x4e02, 0, 200,
+				NULL, NULL) != EXIT_SUCCESS) {
+			fb_destroy(&fb);
+			return EXIT_FAILURE;
+		}
+		fb_flush(&fb);
+	}
+	elapsed[0] = now() - start;
+	start = now();
+	for (int i = 0; i < iterations; i++) {
+		fb_clear(&fb, (i & 1) ? 0x4e02 : 0x123456, 0, 0, 0, 0);
+		fb_flush(&fb);
+	}
+	elapsed[1] = now() - start;
+	printf("rotate %d %ubpp 800x480: status line %.1f us, full clear %.1f us\n",
+		rotate, bpp, elapsed[0] / iterations * 1e6, elapsed[1] / iterations * 1e6);
+	fb_destroy(&fb);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * 800x480 logo drawn on a screen of its size, from a temporary file of
+ * given format: 16 or 32 for raw, 24 for PPM.
+ */
+static int bench_image(const unsigned int bpp, const unsigned int image_bpp,
+		const int iterations) {
+	const int width = 800;
+	const int height = 480;
+	char path[] = "/tmp/text2screen-bench-XXXXXX";
+	const int fd = mkstemp(path);
+	FILE *f = fd >= 0 ? fdopen(fd, "wb") : NULL;
+	if (f == NULL) {
+		perror("Could not create image");
+		if (fd >= 0) {
+			close(fd);
+			unlink(path);
+		}
+		return EXIT_FAILURE;
+	}
+	if (image_bpp == 24) {
+		fprintf(f, "P6\n%d %d\n255\n", width, height);
+	}
+	for (int i = 0; i < width * height; i++) {
+		const uint32_t pixel = i * 2654435761U;
+		fwrite(&pixel, image_bpp / 8, 1, f);
+	}
+	const int written = ferror(f);
+	fclose(f);
+	char raw[32];
+	snprintf(raw, sizeof(raw), "%dx%dx%u", width, height, image_bpp);
+	struct fb fb;
+	int ret = EXIT_FAILURE;
+	if (written == 0 && bench_fb_init(&fb, width, height, bpp, 0,
+			FB_PRESENT_DIRECT, 1) == EXIT_SUCCESS) {
+		const double start = now();
+		ret = EXIT_SUCCESS;
+		for (int i = 0; ret == EXIT_SUCCESS && i < iterations; i++) {
+			ret = fb_image(&fb, path, image_bpp == 24 ? NULL : raw, 0, 0, NULL, NULL);
+		}
+		const double elapsed = now() - start;
+		printf("image %s %dx%d on %ubpp: %.2f ms\n",
+			image_bpp == 24 ? "ppm" : image_bpp == 16 ? "rgb565" : "xrgb8888",
+			width, height, bpp, elapsed / iterations * 1e3);
+		fb_destroy(&fb);
+	}
+	unlink(path);
+	return ret;
+}
+
+/*
+ * Full-screen clears and a line of large text on 1 to max_threads threads,
+ * showing how band rendering scales.
+ */
+static int bench_threads(const int max_threads, const int iterations) {
+	const int width = 1920;
+	const int height = 1080;
+	for (int threads = 1; threads <= max_threads; threads *= 2) {
+		struct fb fb;
+		if (bench_fb_init(&fb, width, height, 32, 0, FB_PRESENT_DIRECT,
+				threads) != EXIT_SUCCESS) {
+			return EXIT_FAILURE;
+		}
+		double start = now();
+		for (int i = 0; i < iterations; i++) {
+			fb_clear(&fb, (i & 1) ? 0x4e02 : 0x123456, 0, 0, 0, 0);
+		}
+		const double clear = now() - start;
+		start = now();
+		for (int i = 0; i < iterations; i++) {
+			fb_write_text(&fb, status_text, 8, true, 0xffffff,
+				(i & 1) ? 0x4e02 : 0x123456, 0, 0, NULL, NULL);
+		}
+		const double text = now() - start;
+		const double pixels = (double)width * height * iterations;
+		printf("threads %d %dx%d: clear %.1f MPixel/s, text scale 8 %.1f us\n",
+			fb.threads, width, height, pixels / clear / 1e6, text / iterations * 1e6);
+		fb_destroy(&fb);
+	}
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Log lines tailed by the console from a temporary file, scrolling by
+ * panning in direct mode and by memmove in copy mode.
+ */
+static int bench_console(const enum fb_present present, const int iterations) {
+	const int lines = iterations * 50;
+	char path[] = "/tmp/text2screen-bench-XXXXXX";
+	const int fd = mkstemp(path);
+	FILE *f = fd >= 0 ? fdopen(fd, "w+") : NULL;
+	if (f == NULL) {
+		perror("Could not create log");
+		if (fd >= 0) {
+			close(fd);
+			unlink(path);
+		}
+		return EXIT_FAILURE;
+	}
+	for (int i = 0; i < lines; i++) {
+		fprintf(f, "[%8.3f] %s %d\n", i / 1000.0, status_text, i);
+	}
+	struct fb fb;
+	int ret = EXIT_FAILURE;
+	if (fflush(f) == 0 && bench_fb_init(&fb, 800, 480, 16, 0, present, 1) == EXIT_SUCCESS) {
+		lseek(fd, 0, SEEK_SET);
+		const double start = now();
+		ret = fb_console(&fb, fd, 1, 0xffffff, 0x4e02, 0, 0);
+		const double elapsed = now() - start;
+		printf("console 800x480 16bpp %s: %.0f lines/s\n",
+			present_names[present], lines / elapsed);
+		fb_destroy(&fb);
+	}
+	fclose(f);
+	unlink(path);
+	return ret;
+}
+
+/*
+ * Full-screen clears and status lines, each drawn then flushed, on a real
+ * device when given, else on a fake one where flushing is only the
+ * presentation copy.
+ */
+static int bench_flush(const char *device, const unsigned int bpp,
+		const enum fb_present present, const int iterations) {
+	struct fb fb;
+	int ret;
+	if (device != NULL) {
+		memset(&fb, 0, sizeof(fb));
+		fb.device = device;
+		fb.present = present;
+		ret = fb_init(&fb);
+	} else {
+		ret = bench_fb_init(&fb, 800, 480, bpp, 0, present, 1);
+	}
+	if (ret != EXIT_SUCCESS) {
+		return EXIT_FAILURE;
+	}
+	if (fb.present != present) {
+		/* flip fell back to copy */
+		fb_destroy(&fb);
+		return EXIT_SUCCESS;
+	}
+	double start = now();
+	for (int i = 0; i < iterations; i++) {
+		fb_clear(&fb, (i & 1) ? 0x4e02 : 0x123456, 0, 0, 0, 0);
+		fb_flush(&fb);
+	}
+	const double clear = now() - start;
+	start = now();
+	for (int i = 0; i < iterations; i++) {
+		fb_write_text(&fb, status_text, 2, true,
+			0xffffff, (i & 1) ? 0x4e02 : 0x123456, 0, 0, NULL, NULL);
+		fb_flush(&fb);
+	}
+	const double text = now() - start;
+	printf("flush %s %s %dx%d %ubpp: clear %.1f us, text %.1f us\n",
+		present_names[present], device != NULL ? device : "fake",
+		fb.width, fb.height, fb.depth * 8,
+		clear / iterations * 1e6, text / iterations * 1e6);
+	fb_destroy(&fb);
+	return EXIT_SUCCESS;
+}
+
+/* Draws a fixed screen exercising clears, scales, alignment and both text modes */
+static int golden_scene(struct fb *fb) {
+	int ret = fb_clear(fb, 0x000000, 0, 0, 0, 0);
+	ret |= fb_clear(fb, 0x202080, 8, 8, fb->width - 16, 40);
+	ret |= fb_write_text(fb, "INITRD BOOT MENU", 2, false, 0, 0xffffff,
+		0, 20, "center", NULL);
+	ret |= fb_write_text(fb, "1) Internal eMMC", 1, true, 0x404040, 0x4e02,
+		16, 64, NULL, NULL);
+	ret |= fb_write_text(fb, "2) MMC card", 1, false, 0, 0xffff00, 16, 80, NULL, NULL);
+	ret |= fb_clear(fb, 0xff0000, 16, 100, 100, -8);
+	ret |= fb_write_text(fb, "OK", 3, true, 0x00ff00, 0x000000,
+		0, 0, "right", "bottom");
+	return ret;
+}
+
+/* Draws golden scene with translucent boxes and text over it */
+static int blend_scene(struct fb *fb) {
+	int ret = golden_scene(fb);
+	ret |= fb_clear(fb, 0x80000000, 0, fb->height / 2, fb->width, fb->height / 4);
+	ret |= fb_clear(fb, 0x40ff8000, 4, 4, fb->width / 2 + 3, fb->height / 2 + 5);
+	ret |= fb_write_text(fb, "Please wait", 2, true, 0x60202080, 0xc0ffffff,
+		0, 0, "center", "center");
+	ret |= fb_write_text(fb, "v1.0", 1, false, 0, 0x20ffffff, 0, 0, "left", "bottom");
+	return ret;
+}
+
+static const char *const status_lines[] = {
+	"Starting initfs", "Loading modules", "Mounting root", "Checking file systems",
+	"Booting"
+};
+
+/* Lines of a status screen, one of them scaled */
+static int status_scene(struct fb *fb) {
+	int ret = EXIT_SUCCESS;
+	for (size_t i = 0; i < sizeof(status_lines) / sizeof(status_lines[0]); i++) {
+		ret |= fb_write_text(fb, status_lines[i], i == 2 ? 2 : 1, true, 0x202020,
+			0xffffff, 8, 8 + (int)i * 24, NULL, NULL);
+	}
+	return ret;
+}
+
+/*
+ * Status screen drawn, partly overwritten by clears and other text, then
+ * drawn again with flushes in between, as boot scripts redraw it, so cells
+ * kept from the first pass must be exactly those left untouched. Text is
+ * opaque, translucent text drawn twice is blended twice. Its references
+ * come from a renderer that redrew every cell.
+ */
+static int rewrite_scene(struct fb *fb) {
+	int ret = fb_clear(fb, 0x000040, 0, 0, 0, 0);
+	ret |= status_scene(fb);
+	fb_flush(fb);
+	ret |= fb_clear(fb, 0x4e02, 13, 11, fb->width / 3, 14);
+	ret |= fb_write_text(fb, "Loading drivers", 1, true, 0x202020, 0x00ff00,
+		8, 32, NULL, NULL);
+	ret |= fb_write_text(fb, "XX", 2, false, 0, 0xff0000, 31, 25, NULL, NULL);
+	ret |= fb_clear(fb, 0xff0000, 40, 40, 30, 20);
+	ret |= fb_progress(fb, 40, 0, 50, 0, 10, 0x00ff00, 0x404040, "40%", 0xffffff, 1);
+	fb_flush(fb);
+	ret |= status_scene(fb);
+	return ret;
+}
+
+/* Status screen drawn once on a fresh screen, what rewrite_scene() must leave */
+static int fresh_scene(struct fb *fb) {
+	int ret = fb_clear(fb, 0x000040, 0, 0, 0, 0);
+	ret |= fb_clear(fb, 0x4e02, 13, 11, fb->width / 3, 14);
+	ret |= fb_write_text(fb, "XX", 2, false, 0, 0xff0000, 31, 25, NULL, NULL);
+	ret |= fb_clear(fb, 0xff0000, 40, 40, 30, 20);
+	ret |= fb_progress(fb, 40, 0, 50, 0, 10, 0x00ff00, 0x404040, "40%", 0xffffff, 1);
+	ret |= status_scene(fb);
+	return ret;
+}
+
+/*
+ * Compares rendering of scene against dir/<name>-<w>x<h>x<bpp>.raw, holding
+ * the visible pixels row after row. A missing file fails; with update the
+ * file is written from the current rendering instead, to be reviewed.
+ */
+static int bench_golden(const char *dir, const bool update, const char *name,
+		int (*scene)(struct fb *fb), const int width, const int height,
+		const unsigned int bpp, const int threads) {
+	struct fb fb;
+	if (bench_fb_init(&fb, width, height, bpp, width * bpp / 8 + 32,
+			FB_PRESENT_DIRECT, threads) != EXIT_SUCCESS) {
+		return EXIT_FAILURE;
+	}
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s-%dx%dx%u.raw", dir, name, width, height, bpp);
+	const size_t row_size = (size_t)fb.width * fb.depth;
+	int ret = scene(&fb);
+	FILE *golden = ret != EXIT_SUCCESS ? NULL : fopen(path, update ? "wb" : "rb");
+	if (ret != EXIT_SUCCESS) {
+		fprintf(stderr, "golden %s: drawing failed\n", path);
+	} else if (update) {
+		for (int y = 0; golden != NULL && y < fb.height; y++) {
+			fwrite((uint8_t *)fb.mem + (size_t)y * fb.line_len, 1, row_size, golden);
+		}
+		if (golden == NULL || ferror(golden)) {
+			perror(path);
+			ret = EXIT_FAILURE;
+		} else {
+			printf("golden %s: written\n", path);
+		}
+	} else if (golden == NULL && errno == ENOENT) {
+		fprintf(stderr, "golden %s: missing, --golden-update writes it\n", path);
+		ret = EXIT_FAILURE;
+	} else if (golden == NULL) {
+		perror(path);
+		ret = EXIT_FAILURE;
+	} else {
+		uint8_t expected[row_size];
+		unsigned int bad_rows = 0;
+		for (int y = 0; y < fb.height; y++) {
+			if (fread(expected, 1, row_size, golden) != row_size ||
+					memcmp(expected, (uint8_t *)fb.mem + (size_t)y * fb.line_len,
+						row_size) != 0) {
+				++bad_rows;
+			}
+		}
+		ret = bad_rows == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+		printf("golden %s: %s", path, bad_rows ? "MISMATCH" : "ok");
+		if (bad_rows) {
+			printf(", %u of %d rows differ", bad_rows, fb.height);
+		}
+		putchar('\n');
+	}
+	if (golden != NULL) {
+		fclose(golden);
+	}
+	fb_destroy(&fb);
+	return ret;
+}
+
+/* Checks that rewrite_scene() leaves the same pixels as fresh_scene() */
+static int bench_golden_rewrite(const int width, const int height, const unsigned int bpp,
+		const int threads) {
+	struct fb rewritten;
+	struct fb fresh;
+	if (bench_fb_init(&rewritten, width, height, bpp, 0, FB_PRESENT_DIRECT,
+			threads) != EXIT_SUCCESS) {
+		return EXIT_FAILURE;
+	}
+	if (bench_fb_init(&fresh, width, height, bpp, 0, FB_PRESENT_DIRECT,
+			threads) != EXIT_SUCCESS) {
+		fb_destroy(&rewritten);
+		return EXIT_FAILURE;
+	}
+	int ret = rewrite_scene(&rewritten) | fresh_scene(&fresh);
+	unsigned int bad_rows = 0;
+	for (int y = 0; ret == EXIT_SUCCESS && y < fresh.height; y++) {
+		const size_t offset = (size_t)y * fresh.line_len;
+		if (memcmp((uint8_t *)rewritten.mem + offset, (uint8_t *)fresh.mem + offset,
+				(size_t)fresh.width * fresh.depth) != 0) {
+			++bad_rows;
+		}
+	}
+	printf("golden rewrite %dx%dx%u: %s", width, height, bpp,
+		ret != EXIT_SUCCESS ? "drawing failed" : bad_rows ? "MISMATCH" : "ok");
+	if (bad_rows) {
+		printf(", %u of %d rows differ from a fresh rendering", bad_rows, fresh.height);
+		ret = EXIT_FAILURE;
+	}
+	putchar('\n');
+	fb_destroy(&rewritten);
+	fb_destroy(&fresh);
+	return ret;
+}
+
+/* Draws golden scene, flushes, then changes part of it, flushing again */
+static int rotate_scene(struct fb *fb) {
+	int ret = golden_scene(fb);
+	fb_flush(fb);
+	ret |= fb_write_text(fb, "Booting", 1, true, 0x000080, 0xffffff, 5, 7, NULL, NULL);
+	ret |= fb_clear(fb, 0x8000ff00, fb->width - 37, 3, 29, fb->height / 2);
+	fb_flush(fb);
+	return ret;
+}
+
+/*
+ * Checks rotate_scene() on a width x height screen turned by angle against
+ * its upright rendering, read back pixel by pixel through the rotation.
+ */
+static int bench_golden_rotate(const int width, const int height, const unsigned int bpp,
+		const int angle, const int threads) {
+	const bool turned = angle != 180;
+	struct fb upright;
+	if (bench_fb_init(&upright, turned ? height : width, turned ? width : height, bpp, 0,
+			FB_PRESENT_DIRECT, threads) != EXIT_SUCCESS) {
+		return EXIT_FAILURE;
+	}
+	char device[64];
+	snprintf(device, sizeof(device), "fake:%dx%dx%u,stride=%u", width, height, bpp,
+		width * bpp / 8 + 32);
+	struct fb fb = {.device = device, .rotate = angle, .threads = threads};
+	if (fb_init(&fb) != EXIT_SUCCESS) {
+		fb_destroy(&upright);
+		return EXIT_FAILURE;
+	}
+	fb.device = "fake";
+	int ret = rotate_scene(&upright) | rotate_scene(&fb);
+	/* between flushes screen holds the turned pixels */
+	const struct fb_plane *screen = &fb.screen;
+	const uint32_t depth = upright.depth;
+	unsigned int bad_rows = 0;
+	for (int y = 0; ret == EXIT_SUCCESS && y < screen->height; y++) {
+		bool bad = false;
+		for (int x = 0; x < screen->width && !bad; x++) {
+			/* upright pixel turned clockwise onto x, y */
+			const int ux = angle == 90 ? y : angle == 180 ? upright.width - 1 - x :
+				upright.width - 1 - y;
+			const int uy = angle == 90 ? upright.height - 1 - x :
+				angle == 180 ? upright.height - 1 - y : x;
+			bad = memcmp((const uint8_t *)screen->mem + (size_t)y * screen->line_len +
+					(size_t)x * depth,
+				(const uint8_t *)upright.mem + (size_t)uy * upright.line_len +
+					(size_t)ux * depth, depth) != 0;
+		}
+		bad_rows += bad;
+	}
+	printf("golden rotate %d %dx%dx%u: %s", angle, width, height, bpp,
+		ret != EXIT_SUCCESS ? "drawing failed" : bad_rows ? "MISMATCH" : "ok");
+	if (bad_rows) {
+		printf(", %u of %d rows differ from the upright rendering", bad_rows,
+			screen->height);
+		ret = EXIT_FAILURE;
+	}
+	putchar('\n');
+	fb_destroy(&fb);
+	fb_destroy(&upright);
+	return ret;
+}
+
+int main(int argc, const char *argv[]) {
+	int iterations = 200;
+	char *device = NULL;
+	char *golden = NULL;
+	int golden_update = 0;
+	char *font = NULL;
+	int threads = 0;
+	const struct poptOption options[] = {
+		{"iterations", 'i', POPT_ARG_INT, &iterations, 0,
+			"Repeat each measurement. Default is 200", "<int>"},
+		{"device", 'd', POPT_ARG_STRING, &device, 0,
+			"Also time flushes on this framebuffer device", "<device>"},
+		{"golden", 'g', POPT_ARG_STRING, &golden, 0,
+			"Compare renderings against images in directory", "<dir>"},
+		{"golden-update", 0, POPT_ARG_NONE, &golden_update, 0,
+			"Write images of this build to the --golden directory instead", NULL},
+		{"font", 'f', POPT_ARG_STRING, &font, 0,
+			"Also time text in this PSF font", "<file>"},
+		{"threads", 'j', POPT_ARG_INT, &threads, 0,
+			"Time band rendering on up to this many threads, default 4,"
+			" or draw golden scenes on them, default 1", "<int>"},
+		POPT_TABLEEND
+	};
+	const struct poptOption popts[] = {
+		{NULL, 0, POPT_ARG_INCLUDE_TABLE, &options, 0, "Options:", NULL},
+		POPT_AUTOHELP
+		POPT_TABLEEND
+	};
+	poptContext ctx = poptGetContext(NULL, argc, argv, popts, POPT_CONTEXT_NO_EXEC);
+	const int rc = poptGetNextOpt(ctx);
+	int ret = EXIT_SUCCESS;
+	if (rc != -1) {
+		fprintf(stderr, "%s: %s\n",
+			poptBadOption(ctx, POPT_BADOPTION_NOALIAS),
+			poptStrerror(rc));
+		ret = EXIT_FAILURE;
+	} else if (iterations <= 0 || poptPeekArg(ctx) != NULL) {
+		poptPrintHelp(ctx, stderr, 0);
+		ret = EXIT_FAILURE;
+	} else if (golden_update && golden == NULL) {
+		fputs("--golden-update needs --golden\n", stderr);
+		ret = EXIT_FAILURE;
+	} else if (golden != NULL) {
+		/* small, one with odd geometry, so references stay small too */
+		static const int sizes[][2] = {{320, 240}, {331, 197}};
+		for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+			for (size_t b = 0; b < sizeof(bpps) / sizeof(bpps[0]); b++) {
+				const int width = sizes[i][0];
+				const int height = sizes[i][1];
+				const int jobs = threads > 0 ? threads : 1;
+				ret |= bench_golden(golden, golden_update, "scene", golden_scene,
+					width, height, bpps[b], jobs);
+				ret |= bench_golden(golden, golden_update, "blend", blend_scene,
+					width, height, bpps[b], jobs);
+				ret |= bench_golden(golden, golden_update, "rewrite", rewrite_scene,
+					width, height, bpps[b], jobs);
+				ret |= bench_golden_rewrite(width, height, bpps[b], jobs);
+				for (int angle = 90; angle < 360; angle += 90) {
+					ret |= bench_golden_rotate(width, height, bpps[b], angle, jobs);
+				}
+			}
+		}
+	} else {
+		static const int sizes[][2] = {{320, 240}, {800, 480}, {1920, 1080}};
+		for (size_t b = 0; b < sizeof(bpps) / sizeof(bpps[0]); b++) {
+			for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+				ret |= bench_clear(sizes[i][0], sizes[i][1], bpps[b], 0, iterations);
+			}
+			/* lines padded like many display controllers do */
+			ret |= bench_clear(800, 480, bpps[b], 800 * bpps[b] / 8 + 64, iterations);
+		}
+		for (size_t b = 0; b < sizeof(bpps) / sizeof(bpps[0]); b++) {
+			for (int scale = 1; scale <= 8; scale *= 2) {
+				ret |= bench_text(bpps[b], scale, true, NULL, iterations);
+				ret |= bench_text(bpps[b], scale, false, NULL, iterations);
+			}
+			for (int scale = 1; font != NULL && scale <= 2; scale++) {
+				ret |= bench_text(bpps[b], scale, true, font, iterations);
+				ret |= bench_text(bpps[b], scale, false, font, iterations);
+			}
+		}
+		for (unsigned int bpp = 16; bpp <= 32; bpp += 16) {
+			ret |= bench_status(bpp, iterations);
+			ret |= bench_overlay(bpp, iterations);
+		}
+		for (size_t b = 0; b < sizeof(bpps) / sizeof(bpps[0]); b++) {
+			for (unsigned int image_bpp = 16; image_bpp <= 32; image_bpp += 8) {
+				ret |= bench_image(bpps[b], image_bpp, iterations);
+			}
+		}
+		for (unsigned int bpp = 16; bpp <= 32; bpp += 16) {
+			for (int rotate = 0; rotate < 360; rotate += 90) {
+				ret |= bench_rotate(bpp, rotate, iterations);
+			}
+		}
+		ret |= bench_threads(threads > 0 ? threads : 4, iterations);
+		ret |= bench_console(FB_PRESENT_DIRECT, iterations);
+		ret |= bench_console(FB_PRESENT_COPY, iterations);
+		for (unsigned int bpp = 16; bpp <= 32; bpp += 16) {
+			for (int present = FB_PRESENT_DIRECT; present <= FB_PRESENT_FLIP; present++) {
+				ret |= bench_flush(NULL, bpp, (enum fb_present)present, iterations);
+			}
+		}
+		for (int present = FB_PRESENT_DIRECT; device != NULL && present <= FB_PRESENT_FLIP;
+				present++) {
+			ret |= bench_flush(device, 0, (enum fb_present)present, iterations);
+		}
+	}
+	poptFreeContext(ctx);
+	return ret;
+}
@@ -0,0 +1,313 @@
+/*
+	This file is part of fb_text2screen.
+
+	fb_text2screen is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	fb_text2screen is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with fb_text2screen.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Splash compiler, run on the build host. Draws text2screen batch lines
+ * on a fake framebuffer of the target's geometry twice, once over black
+ * and once over white, and writes the pixels that came out the same over
+ * both as a patch for text2screen --patch, together with the lines.
+ */
+
+#pragma GCC diagnostic ignored "-Wunused-function"
+#include "multicall.h"
+#define main text2screen_main
+#include "text2screen.c"
+#undef main
+
+#include <limits.h>
+#include <stdio.h>
+
+/* Runs of at least this many equal pixels are filled rather than copied */
+#define PATCH_FILL_MIN 4
+/* Largest pixel count of one op */
+#define PATCH_COUNT_MAX (UINT32_MAX >> PATCH_OP_BITS)
+
+/* Appends size bytes of data to stream, padded with zeros to 4 bytes */
+static void put_padded(FILE *stream, const void *data, const size_t size) {
+	static const uint8_t zeros[4];
+	fwrite(data, 1, size, stream);
+	fwrite(zeros, 1, (4 - size % 4) % 4, stream);
+}
+
+/* Appends op word, splitting skips too long for one */
+static void put_op(FILE *stream, const enum patch_op op, size_t count) {
+	do {
+		const size_t n = count < PATCH_COUNT_MAX ? count : PATCH_COUNT_MAX;
+		const uint32_t word = (uint32_t)n << PATCH_OP_BITS | op;
+		fwrite(&word, sizeof(word), 1, stream);
+		count -= n;
+	} while (op == PATCH_SKIP && count > 0);
+}
+
+/* Returns whether pixel at in holds byte value in each of depth bytes */
+static bool pixel_is(const uint8_t *in, const uint8_t value, const uint32_t depth) {
+	for (uint32_t i = 0; i < depth; i++) {
+		if (in[i] != value) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Encodes pixels drawn alike over black and white as patch ops. Pixels
+ * still black and white were left alone; others depend on what was on
+ * screen, e.g. translucent colors, and can't be compiled.
+ */
+static int patch_encode(FILE *ops, const struct fb *fb, const uint8_t *black,
+		const uint8_t *white) {
+	const uint32_t depth = fb->depth;
+	size_t skip = 0;
+	for (int y = 0; y < fb->height; y++) {
+		const uint8_t *a = black + (size_t)y * fb->line_len;
+		const uint8_t *b = white + (size_t)y * fb->line_len;
+		int x = 0;
+		while (x < fb->width) {
+			if (memcmp(a + x * depth, b + x * depth, depth) != 0) {
+				if (!pixel_is(a + x * depth, 0, depth) ||
+						!pixel_is(b + x * depth, 0xff, depth)) {
+					fprintf(stderr, "Pixel %d,%d depends on the screen below,"
+						" e.g. through a translucent color\n", x, y);
+					return EXIT_FAILURE;
+				}
+				++skip;
+				++x;
+				continue;
+			}
+			if (skip > 0) {
+				put_op(ops, PATCH_SKIP, skip);
+				skip = 0;
+			}
+			/* literal pixels up to the next long run of equal ones */
+			int end = x;
+			int run = 0;
+			while (end < fb->width && memcmp(a + end * depth, b + end * depth, depth) == 0) {
+				run = 1;
+				while (end + run < fb->width && memcmp(a + (end + run) * depth,
+						b + (end + run) * depth, depth) == 0 &&
+						memcmp(a + (end + run) * depth, a + end * depth, depth) == 0) {
+					++run;
+				}
+				if (run >= PATCH_FILL_MIN) {
+					break;
+				}
+				end += run;
+			}
+			if (end > x) {
+				put_op(ops, PATCH_COPY, end - x);
+				put_padded(ops, a + x * depth, (size_t)(end - x) * depth);
+				x = end;
+			}
+			if (run >= PATCH_FILL_MIN) {
+				put_op(ops, PATCH_FILL, run);
+				put_padded(ops, a + x * depth, depth);
+				x += run;
+			}
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+/* Creates empty temporary file and stores its name in path */
+static int temp_file(char *path, const size_t size) {
+	const char *dir = getenv("TMPDIR");
+	snprintf(path, size, "%s/text2screen-splash-XXXXXX", dir != NULL ? dir : "/tmp");
+	const int fd = mkstemp(path);
+	if (fd < 0) {
+		perror("Could not create temporary file");
+		path[0] = '\0';
+		return EXIT_FAILURE;
+	}
+	close(fd);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Runs script with text2screen on fake device spec backed by file screen,
+ * which starts out with all bytes set to base, and opens the result in fb.
+ */
+static int render(struct fb *fb, const char *spec, const char *screen,
+		const char *script, const uint8_t base) {
+	char device[PATH_MAX + 256];
+	snprintf(device, sizeof(device), "%s,file=%s", spec, screen);
+	memset(fb, 0, sizeof(*fb));
+	fb->device = device;
+	fb->present = FB_PRESENT_COPY;
+	if (fb_init(fb) != EXIT_SUCCESS) {
+		return EXIT_FAILURE;
+	}
+	memset(fb->vmem, base, fb->vsize);
+	fb_destroy(fb);
+	const char *args[] = {"text2screen", "--batch", script, device, NULL};
+	if (text2screen_main(4, args) != EXIT_SUCCESS) {
+		return EXIT_FAILURE;
+	}
+	memset(fb, 0, sizeof(*fb));
+	fb->device = device;
+	fb->present = FB_PRESENT_COPY;
+	const int ret = fb_init(fb);
+	fb->device = "fake";
+	return ret;
+}
+
+/* Writes patch of screens drawn over black and white with script to path */
+static int patch_write(const char *path, const struct fb *black, const struct fb *white,
+		const char *script, const size_t script_size) {
+	char *ops = NULL;
+	size_t ops_size = 0;
+	FILE *ops_stream = open_memstream(&ops, &ops_size);
+	if (ops_stream == NULL) {
+		perror("Could not allocate patch");
+		return EXIT_FAILURE;
+	}
+	int ret = patch_encode(ops_stream, black, black->mem, white->mem);
+	if (fclose(ops_stream) != 0) {
+		perror("Could not allocate patch");
+		ret = EXIT_FAILURE;
+	}
+	struct patch_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, PATCH_MAGIC, sizeof(header.magic));
+	header.version = PATCH_VERSION;
+	header.width = black->width;
+	header.height = black->height;
+	header.depth = black->depth;
+	memcpy(header.channels, black->format.channels, sizeof(header.channels));
+	header.script_offset = sizeof(header);
+	header.script_size = script_size;
+	header.ops_offset = (sizeof(header) + script_size + 3) & ~(size_t)3;
+	header.ops_size = ops_size;
+	FILE *out = NULL;
+	if (ret == EXIT_SUCCESS &&
+			(out = strcmp(path, "-") == 0 ? stdout : fopen(path, "wb")) == NULL) {
+		perror("Could not open output");
+		ret = EXIT_FAILURE;
+	}
+	if (out != NULL) {
+		fwrite(&header, sizeof(header), 1, out);
+		put_padded(out, script, script_size);
+		fwrite(ops, 1, ops_size, out);
+		if (ferror(out) || (out != stdout ? fclose(out) : fflush(out)) != 0) {
+			perror("Could not write patch");
+			ret = EXIT_FAILURE;
+		}
+	}
+	free(ops);
+	return ret;
+}
+
+int main(int argc, const char *argv[]) {
+	char *output = NULL;
+	char *batch = NULL;
+	const struct poptOption options[] = {
+		{"output", 'o', POPT_ARG_STRING, &output, 0,
+			"Patch file to write, - for stdout", "<file>"},
+		{"batch", 0, POPT_ARG_STRING, &batch, 0,
+			"Draw lines of text2screen options from file, - for stdin,"
+			" before those given as arguments", "<file>"},
+		POPT_TABLEEND
+	};
+	const struct poptOption popts[] = {
+		{NULL, 0, POPT_ARG_INCLUDE_TABLE, &options, 0, "Options:", NULL},
+		POPT_AUTOHELP
+		POPT_TABLEEND
+	};
+	poptContext ctx = poptGetContext(NULL, argc, argv, popts, POPT_CONTEXT_NO_EXEC);
+	poptSetOtherOptionHelp(ctx,
+		"[OPTION...] fake:<width>x<height>x<bpp>[,bgr] [-- LINE...]");
+	const int rc = poptGetNextOpt(ctx);
+	const char *spec = rc == -1 ? poptGetArg(ctx) : NULL;
+	if (rc != -1) {
+		fprintf(stderr, "%s: %s\n",
+			poptBadOption(ctx, POPT_BADOPTION_NOALIAS),
+			poptStrerror(rc));
+		poptFreeContext(ctx);
+		return EXIT_FAILURE;
+	} else if (output == NULL || spec == NULL) {
+		poptPrintHelp(ctx, stderr, 0);
+		poptFreeContext(ctx);
+		return EXIT_FAILURE;
+	} else if (strncmp(spec, "fake:", 5) != 0 || strstr(spec, "file=") != NULL) {
+		fputs("Target must be given as fake device without file\n", stderr);
+		poptFreeContext(ctx);
+		return EXIT_FAILURE;
+	}
+	/* script is the batch file followed by the lines given */
+	char *script = NULL;
+	size_t script_size = 0;
+	FILE *script_stream = open_memstream(&script, &script_size);
+	FILE *in = batch == NULL ? NULL : strcmp(batch, "-") == 0 ? stdin : fopen(batch, "r");
+	int ret = script_stream != NULL && (batch == NULL || in != NULL) ?
+		EXIT_SUCCESS : EXIT_FAILURE;
+	if (ret != EXIT_SUCCESS) {
+		perror(script_stream == NULL ? "Could not allocate script" : "Could not open batch file");
+	}
+	char buf[4096];
+	size_t got;
+	while (ret == EXIT_SUCCESS && in != NULL && (got = fread(buf, 1, sizeof(buf), in)) > 0) {
+		fwrite(buf, 1, got, script_stream);
+	}
+	if (in != NULL && in != stdin) {
+		fclose(in);
+	}
+	for (const char *line; ret == EXIT_SUCCESS && (line = poptGetArg(ctx)) != NULL; ) {
+		fprintf(script_stream, "%s\n", line);
+	}
+	if (script_stream != NULL) {
+		fclose(script_stream);
+	}
+	if (ret == EXIT_SUCCESS && script_size == 0) {
+		fputs("No lines to draw given\n", stderr);
+		ret = EXIT_FAILURE;
+	}
+	char script_path[PATH_MAX] = "";
+	char black_path[PATH_MAX] = "";
+	char white_path[PATH_MAX] = "";
+	struct fb black = {.mem = NULL};
+	struct fb white = {.mem = NULL};
+	if (ret == EXIT_SUCCESS) {
+		FILE *script_file = NULL;
+		ret = temp_file(script_path, sizeof(script_path)) == EXIT_SUCCESS &&
+			temp_file(black_path, sizeof(black_path)) == EXIT_SUCCESS &&
+			temp_file(white_path, sizeof(white_path)) == EXIT_SUCCESS &&
+			(script_file = fopen(script_path, "w")) != NULL ? EXIT_SUCCESS : EXIT_FAILURE;
+		if (script_file != NULL) {
+			const bool written = fwrite(script, 1, script_size, script_file) == script_size;
+			if (fclose(script_file) != 0 || !written) {
+				perror("Could not write script");
+				ret = EXIT_FAILURE;
+			}
+		}
+	}
+	if (ret == EXIT_SUCCESS && render(&black, spec, black_path, script_path, 0) == EXIT_SUCCESS &&
+			render(&white, spec, white_path, script_path, 0xff) == EXIT_SUCCESS) {
+		ret = patch_write(output, &black, &white, script, script_size);
+	} else {
+		ret = EXIT_FAILURE;
+	}
+	fb_destroy(&black);
+	fb_destroy(&white);
+	const char *paths[] = {script_path, black_path, white_path};
+	for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+		if (paths[i][0] != '\0') {
+			unlink(paths[i]);
+		}
+	}
+	free(script);
+	poptFreeContext(ctx);
+	return ret;
+}
@@ -28,9 +28,29 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <stdint.h>
 #include <sys/ioctl.h>
 #include <string.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "trace.h"
+
+#ifdef MULTICALL
+#include "multicall.h"
+#define main text2screen_main
+#endif
 
 #ifndef __user
 #define __user
@@ -42,356 +62,4031 @@
   #include <asm-arm/arch-omap/omapfb.h>
 #endif
 
-struct fb {
-	const char *device; /* path to framebuffer device */
-	int fd; /* framebuffer file descriptor */
-	int width; /* screen width (in px) */
-	int height; /* screen height (in px) */
-	uint32_t depth; /* screen depth in bytes per pixel */
-	void *mem; /* mmaped video memory */
-	size_t size; /* mmaped region size */
-	uint32_t line_len; /* buffer line length in bytes */
-};
+/* Most separate damaged areas tracked before flushing the whole screen */
+#define FB_DAMAGE_MAX 4
+
+struct fb_rect {
+	int x;
+	int y;
+	int width;
+	int height;
+};
+
+/* Pixel buffer drawn into, see fb_swap_plane() */
+struct fb_plane {
+	void *mem;
+	size_t size;
+	int width;
+	int height;
+	uint32_t line_len;
+};
+
+/* How drawing reaches the screen */
+enum fb_present {
+	FB_PRESENT_DIRECT, /* draw straight into video memory */
+	FB_PRESENT_COPY, /* draw into back buffer, copy damaged rows on flush */
+	FB_PRESENT_FLIP /* draw into back buffer, show it on the other page */
+};
+
+/* Last drawn progress bar, for redrawing only what changed */
+struct fb_progress {
+	struct fb_rect area;
+	uint32_t fg_color;
+	uint32_t bg_color;
+	int filled; /* width of fg part in px, -1 if unknown */
+};
+
+/* Most text rows remembered at once, see text_row_get() */
+#define TEXT_ROWS_MAX 64
+
+/* What text last drew in a character cell */
+struct text_cell {
+	uint32_t glyph; /* font glyph + 1, 0 if unknown */
+	uint32_t fg_color;
+	uint32_t bg_color; /* 0 unless bg_clear */
+	bool bg_clear;
+};
+
+/*
+ * Character cells of one row of text as last drawn, for redrawing only
+ * cells that change. Cells are cell_width px apart starting at x0, and
+ * are forgotten when anything else is drawn over them.
+ */
+struct text_row {
+	int y; /* top of glyphs */
+	int height; /* glyph height */
+	int scale;
+	int x0; /* left of cell 0, less than cell_width */
+	int cell_width;
+	int cols; /* 0 for unused row */
+	struct text_cell *cells;
+};
+
+/* Position of one color channel within a native pixel */
+struct fb_channel {
+	uint8_t offset;
+	uint8_t length;
+};
+
+/* Native pixel layout, built once from fb_var_screeninfo */
+struct fb_format {
+	struct fb_channel channels[3]; /* red, green, blue */
+	uint32_t opaque; /* alpha channel bits of an opaque pixel, if any */
+};
+
+/*
+ * Translucent color in the forms blend kernels take it, see blend_prepare().
+ * Alpha is fixed point with 256 meaning opaque, so blends divide by shifts.
+ */
+struct fb_blend {
+	uint32_t color; /* 24-bit rgb */
+	uint32_t pixel; /* color in native format */
+	uint32_t alpha; /* 0-256 */
+	uint32_t alpha5; /* alpha scaled to 0-32, for 565 */
+	uint32_t rb; /* pixel bytes 0 and 2 times alpha, for 8888 */
+	uint32_t ag; /* pixel bytes 1 and 3 times alpha, for 8888 */
+	uint32_t spread; /* 565 pixel spread to 0x07e0f81f times alpha5 */
+};
+
+struct fb;
+
+/*
+ * Device specific part of struct fb. Backends open the device, describe
+ * its geometry in the usual fbdev structures and leave mapping the memory
+ * and drawing to common code.
+ */
+struct fb_backend {
+	const char *name;
+	/* Opens fb->device, filling fd (-1 for anonymous memory), vinfo and finfo */
+	int (*open)(struct fb *fb, struct fb_fix_screeninfo *finfo);
+	/* Shows page at vinfo.xoffset/yoffset */
+	int (*pan)(struct fb *fb);
+	/* Refreshes area from video memory, NULL if display does it itself */
+	void (*update)(const struct fb *fb, const struct fb_rect *area);
+	/* Waits for vertical blank, NULL if display can't tell when it is */
+	int (*wait_vsync)(const struct fb *fb);
+};
+
+struct fb {
+	const char *device; /* path to framebuffer device or fake: geometry */
+	enum fb_present present; /* requested presentation mode */
+	const struct fb_backend *backend; /* picked by fb_init() from device */
+	int fd; /* framebuffer file descriptor */
+	int width; /* screen width (in px) */
+	int height; /* screen height (in px) */
+	uint32_t depth; /* screen depth in bytes per pixel */
+	void *mem; /* drawing target, visible page or back buffer */
+	size_t size; /* screen page size in bytes */
+	void *vmem; /* mmaped video memory */
+	size_t vsize; /* mmaped region size, one or two pages */
+	int page; /* page shown in flip mode, 0 or 1 */
+	struct fb_var_screeninfo vinfo; /* as read from device, for panning */
+	uint32_t line_len; /* buffer line length in bytes */
+	struct fb_format format; /* native pixel layout, see fb_pack() */
+	/* pixel size specialized fill kernel, picked by fb_select_kernels() */
+	void (*fill)(void *out, void *row, const struct fb *fb, uint32_t pixel,
+			int width, int height);
+	/* stores n native pixels, picked with fill */
+	void (*span)(void *out, uint32_t pixel, size_t n);
+	/* blends color into n native pixels, reading each once, picked with fill */
+	void (*blend)(const struct fb *fb, uint8_t *out, const struct fb_blend *color, size_t n);
+	void *rows; /* cached scratch lines for row copies, one per band */
+	int threads; /* drawing threads, see fb_parallel() */
+	struct fb_pool *pool; /* NULL when drawing on calling thread only */
+	struct fb_font *font; /* NULL for built-in font, see fb_set_font() */
+	struct glyph_cache *glyphs; /* glyph atlas, see glyph_cache_get() */
+	int update_format; /* OMAPFB_COLOR_* of video memory, for update requests */
+	/* areas drawn since last fb_flush(), damage_count -1 means whole screen */
+	struct fb_rect damage[FB_DAMAGE_MAX];
+	int damage_count;
+	struct fb_progress progress; /* forgotten when drawn over */
+	bool drawn; /* anything damaged yet, after which progress state files aren't read */
+	struct text_row *text_rows; /* TEXT_ROWS_MAX rows or NULL, as progress */
+	int text_row_next; /* row replaced next once all are used */
+	int rotate; /* degrees drawing is turned clockwise on screen: 0, 90, 180 or 270 */
+	bool keep_view; /* fb_init() leaves a shown second page be, for --dump */
+	/* physical buffer while rotating, when mem and geometry are the upright view */
+	struct fb_plane screen;
+};
+
+static int rect_area(const struct fb_rect *r) {
+	return r->width * r->height;
+}
+
+static bool rect_intersects(const struct fb_rect *r, const struct fb_rect *other) {
+	return r->x < other->x + other->width && other->x < r->x + r->width &&
+		r->y < other->y + other->height && other->y < r->y + r->height;
+}
+
+/* Makes r the bounding box of r and other */
+static void rect_union(struct fb_rect *r, const struct fb_rect *other) {
+	const int right = r->x + r->width > other->x + other->width ?
+		r->x + r->width : other->x + other->width;
+	const int bottom = r->y + r->height > other->y + other->height ?
+		r->y + r->height : other->y + other->height;
+	r->x = r->x < other->x ? r->x : other->x;
+	r->y = r->y < other->y ? r->y : other->y;
+	r->width = right - r->x;
+	r->height = bottom - r->y;
+}
+
+/* Forgets text cells overlapping area */
+static void text_forget(struct fb *fb, const struct fb_rect *area) {
+	if (fb->text_rows == NULL) {
+		return;
+	}
+	for (int i = 0; i < TEXT_ROWS_MAX; i++) {
+		struct text_row *row = &fb->text_rows[i];
+		if (row->cols == 0 || area->y >= row->y + row->height ||
+				row->y >= area->y + area->height) {
+			continue;
+		}
+		const int from = (area->x - row->x0) / row->cell_width;
+		const int to = (area->x + area->width - row->x0 + row->cell_width - 1) /
+			row->cell_width;
+		for (int col = from > 0 ? from : 0; col < to && col < row->cols; col++) {
+			row->cells[col].glyph = 0;
+		}
+	}
+}
+
+/*
+ * Adds area to the recorded ones.
+ * An area is merged into a recorded one when their bounding box wastes
+ * at most a third of it on undamaged pixels. Once FB_DAMAGE_MAX separate
+ * areas exist, the whole screen is considered damaged.
+ */
+static void damage_add(struct fb *fb, const struct fb_rect *area) {
+	if (fb->damage_count < 0) {
+		return;
+	}
+	for (int i = 0; i < fb->damage_count; i++) {
+		struct fb_rect merged = fb->damage[i];
+		rect_union(&merged, area);
+		const int used = rect_area(&fb->damage[i]) + rect_area(area);
+		if (rect_area(&merged) * 2 <= used * 3) {
+			/* Recheck others against the grown area */
+			fb->damage[i] = fb->damage[--fb->damage_count];
+			damage_add(fb, &merged);
+			return;
+		}
+	}
+	if (fb->damage_count == FB_DAMAGE_MAX) {
+		fb->damage_count = -1;
+	} else {
+		fb->damage[fb->damage_count++] = *area;
+	}
+}
+
+/*
+ * Records area as changed, for fb_flush() to update, and forgets the
+ * progress bar and text cells drawn over.
+ */
+static void fb_damage(struct fb *fb, const int x, const int y,
+		const int width, const int height) {
+	const struct fb_rect area = {x, y, width, height};
+	if (width <= 0 || height <= 0) {
+		return;
+	}
+	if (rect_intersects(&area, &fb->progress.area)) {
+		fb->progress.filled = -1;
+	}
+	fb->drawn = true;
+	text_forget(fb, &area);
+	damage_add(fb, &area);
+}
+
+/* Converts 16-bit rgb color to 24-bit rgb */
+static inline uint32_t rgb_565_to_888(const uint16_t rgb565) {
+	return (((uint32_t)rgb565 & 0x0000f800) << 8) |
+		(((uint32_t)rgb565 & 0x000007e0) << 5) |
+		(((uint32_t)rgb565 & 0x0000001f) << 3);
+}
+
+/*
+ * Packs 24-bit rgb color into a pixel of fb's native format.
+ * Done once per color and draw call, so kernels only ever store pixels.
+ */
+static uint32_t fb_pack(const struct fb *fb, const uint32_t rgb888) {
+	const struct fb_format *format = &fb->format;
+	uint32_t pixel = format->opaque;
+	for (int i = 0; i < 3; i++) {
+		const struct fb_channel *channel = &format->channels[i];
+		const uint32_t value = rgb888 >> (16 - 8 * i) & 0xff;
+		pixel |= (channel->length >= 8 ? value << (channel->length - 8) :
+			value >> (8 - channel->length)) << channel->offset;
+	}
+	return pixel;
+}
+
+/*
+ * Four pixels at a time, in whatever vector registers the target has.
+ * Vector memory is little-endian like raw images, on both OMAP and x86.
+ */
+typedef uint32_t u32x4 __attribute__((vector_size(16)));
+typedef uint16_t u16x4 __attribute__((vector_size(8)));
+typedef uint8_t u8x4 __attribute__((vector_size(4)));
+
+/*
+ * Lane conversions. __builtin_convertvector needs GCC 9 or clang, older
+ * compilers, like the Maemo ones, convert lane by lane.
+ */
+#ifdef HAVE_BUILTIN_CONVERTVECTOR
+#define VECTOR_CONVERT(from_type, to_type) \
+	static inline to_type from_type##_to_##to_type(const from_type v) { \
+		return __builtin_convertvector(v, to_type); \
+	}
+#else
+#define VECTOR_CONVERT(from_type, to_type) \
+	static inline to_type from_type##_to_##to_type(const from_type v) { \
+		to_type out = { 0 }; \
+		for (int k = 0; k < 4; k++) { \
+			out[k] = v[k]; \
+		} \
+		return out; \
+	}
+#endif
+VECTOR_CONVERT(u8x4, u32x4)
+VECTOR_CONVERT(u16x4, u32x4)
+VECTOR_CONVERT(u32x4, u8x4)
+VECTOR_CONVERT(u32x4, u16x4)
+
+/* Fills below this many bytes per row are stored directly, not row-copied */
+#define FILL_COPY_MIN 64
+
+/* Stores n 8-bit pixels */
+static void span_8(void *out, const uint32_t pixel, size_t n) {
+	memset(out, pixel & 0xff, n);
+}
+
+/* Stores n 16-bit pixels, 64 bits at a time once the pointer is aligned */
+static void span_16(void *out, const uint32_t pixel, size_t n) {
+	const uint16_t color = pixel;
+	if ((color >> 8) == (color & 0xff)) {
+		memset(out, color & 0xff, n * 2);
+		return;
+	}
+	uint16_t *p = (uint16_t *)out;
+	for (; n > 0 && ((uintptr_t)p & 7) != 0; --n) {
+		*p++ = color;
+	}
+	const uint64_t pattern = color * UINT64_C(0x0001000100010001);
+	uint64_t *q = (uint64_t *)(void *)p;
+	for (; n >= 16; n -= 16, q += 4) {
+		q[0] = pattern;
+		q[1] = pattern;
+		q[2] = pattern;
+		q[3] = pattern;
+	}
+	for (; n >= 4; n -= 4) {
+		*q++ = pattern;
+	}
+	p = (uint16_t *)(void *)q;
+	while (n-- > 0) {
+		*p++ = color;
+	}
+}
+
+/*
+ * Stores n packed 24-bit pixels. Once the pointer is 32-bit aligned every
+ * 4 pixels are the same 3 words, so those are stored instead of bytes.
+ */
+static void span_24(void *out, const uint32_t pixel, size_t n) {
+	const uint8_t b0 = pixel, b1 = pixel >> 8, b2 = pixel >> 16;
+	if (b0 == b1 && b1 == b2) {
+		memset(out, b0, n * 3);
+		return;
+	}
+	uint8_t *p = (uint8_t *)out;
+	for (; n > 0 && ((uintptr_t)p & 3) != 0; --n, p += 3) {
+		p[0] = b0;
+		p[1] = b1;
+		p[2] = b2;
+	}
+	const uint8_t pattern_bytes[12] = {b0, b1, b2, b0, b1, b2, b0, b1, b2, b0, b1, b2};
+	uint32_t pattern[3];
+	memcpy(pattern, pattern_bytes, sizeof(pattern));
+	uint32_t *q = (uint32_t *)(void *)p;
+	for (; n >= 4; n -= 4, q += 3) {
+		q[0] = pattern[0];
+		q[1] = pattern[1];
+		q[2] = pattern[2];
+	}
+	for (p = (uint8_t *)q; n > 0; --n, p += 3) {
+		p[0] = b0;
+		p[1] = b1;
+		p[2] = b2;
+	}
+}
+
+/* Stores n 32-bit pixels, 64 bits at a time once the pointer is aligned */
+static void span_32(void *out, const uint32_t pixel, size_t n) {
+	if (pixel == (pixel & 0xff) * 0x01010101U) {
+		memset(out, pixel & 0xff, n * 4);
+		return;
+	}
+	uint32_t *p = (uint32_t *)out;
+	if (n > 0 && ((uintptr_t)p & 7) != 0) {
+		*p++ = pixel;
+		--n;
+	}
+	const uint64_t pattern = pixel * UINT64_C(0x0000000100000001);
+	uint64_t *q = (uint64_t *)(void *)p;
+	for (; n >= 8; n -= 8, q += 4) {
+		q[0] = pattern;
+		q[1] = pattern;
+		q[2] = pattern;
+		q[3] = pattern;
+	}
+	for (; n >= 2; n -= 2) {
+		*q++ = pattern;
+	}
+	if (n > 0) {
+		*(uint32_t *)(void *)q = pixel;
+	}
+}
+
+/* Copies the prepared scratch row into each of height destination rows */
+static void copy_rows(uint8_t *out, const void *row, const struct fb *fb,
+		const size_t row_size, const int height) {
+	for (int j = 0; j < height; j++) {
+		memcpy(out, row, row_size);
+		out += fb->line_len;
+	}
+}
+
+/*
+ * Fills rectangular area with given native pixel.
+ * Expects coordinates and sizes to be validated and normalized.
+ *
+ * When the area spans whole lines without padding it is one contiguous span.
+ * Otherwise wide areas get one row built in scratch line row and copied
+ * into every line, so video memory is only ever written, never read back.
+ * Inlined into one kernel per pixel size, with span constant in each.
+ */
+static inline void fill_with(void *out, void *row, const struct fb *fb,
+		const uint32_t pixel, const int width, const int height,
+		void (*const span)(void *out, uint32_t pixel, size_t n)) {
+	const size_t row_size = (size_t)width * fb->depth;
+	if (row_size == fb->line_len) {
+		span(out, pixel, (size_t)width * height);
+	} else if (height > 1 && row_size >= FILL_COPY_MIN) {
+		span(row, pixel, width);
+		copy_rows((uint8_t *)out, row, fb, row_size, height);
+	} else {
+		for (int j = 0; j < height; j++) {
+			span(out, pixel, width);
+			out = (uint8_t *)out + fb->line_len;
+		}
+	}
+}
+
+static void fill_8(void *out, void *row, const struct fb *fb, const uint32_t pixel,
+		const int width, const int height) {
+	fill_with(out, row, fb, pixel, width, height, span_8);
+}
+
+static void fill_16(void *out, void *row, const struct fb *fb, const uint32_t pixel,
+		const int width, const int height) {
+	fill_with(out, row, fb, pixel, width, height, span_16);
+}
+
+static void fill_24(void *out, void *row, const struct fb *fb, const uint32_t pixel,
+		const int width, const int height) {
+	fill_with(out, row, fb, pixel, width, height, span_24);
+}
+
+static void fill_32(void *out, void *row, const struct fb *fb, const uint32_t pixel,
+		const int width, const int height) {
+	fill_with(out, row, fb, pixel, width, height, span_32);
+}
+
+/*
+ * Prepares color, 0xAARRGGBB, for blending into fb. Alpha 00 is taken as
+ * opaque, so plain 24-bit colors are, and alpha is rounded up to 256
+ * from ff, so the blend of an opaque color is exactly that color.
+ */
+static void blend_prepare(const struct fb *fb, struct fb_blend *blend, const uint32_t color) {
+	const uint32_t alpha = color >> 24;
+	blend->color = color & 0xffffff;
+	blend->pixel = fb_pack(fb, color);
+	blend->alpha = alpha == 0 ? 256 : alpha + (alpha >> 7);
+	blend->alpha5 = (blend->alpha + 4) >> 3;
+	blend->rb = (blend->pixel & 0x00ff00ff) * blend->alpha;
+	blend->ag = (blend->pixel >> 8 & 0x00ff00ff) * blend->alpha;
+	blend->spread = ((blend->pixel | blend->pixel << 16) & 0x07e0f81f) * blend->alpha5;
+}
+
+/* Tells whether color, 0xAARRGGBB, needs no blending */
+static bool color_opaque(const uint32_t color) {
+	const uint32_t alpha = color >> 24;
+	return alpha == 0 || alpha == 0xff;
+}
+
+/*
+ * 8888 blends work on two bytes of every pixel at once, whatever channel
+ * each byte holds, 16 bits apart so products can't overflow into the next.
+ */
+static inline uint32_t blend_8888_pixel(const uint32_t pixel, const struct fb_blend *b) {
+	const uint32_t keep = 256 - b->alpha;
+	return (((pixel & 0x00ff00ff) * keep + b->rb) >> 8 & 0x00ff00ff) |
+		(((pixel >> 8 & 0x00ff00ff) * keep + b->ag) & 0xff00ff00);
+}
+
+static inline u32x4 blend_8888_pixels(const u32x4 pixels, const struct fb_blend *b) {
+	const uint32_t keep = 256 - b->alpha;
+	return (((pixels & 0x00ff00ff) * keep + b->rb) >> 8 & 0x00ff00ff) |
+		(((pixels >> 8 & 0x00ff00ff) * keep + b->ag) & 0xff00ff00);
+}
+
+static void blend_8888(const struct fb *fb, uint8_t *out, const struct fb_blend *b,
+		const size_t n) {
+	(void)fb;
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		u32x4 pixels;
+		memcpy(&pixels, out + 4 * i, sizeof(pixels));
+		pixels = blend_8888_pixels(pixels, b);
+		memcpy(out + 4 * i, &pixels, sizeof(pixels));
+	}
+	for (; i < n; i++) {
+		uint32_t pixel;
+		memcpy(&pixel, out + 4 * i, sizeof(pixel));
+		pixel = blend_8888_pixel(pixel, b);
+		memcpy(out + 4 * i, &pixel, sizeof(pixel));
+	}
+}
+
+/*
+ * 565 blends spread a pixel over 32 bits as 0x07e0f81f, green in the high
+ * half, leaving room for 5-bit alpha products of all three channels.
+ */
+static inline uint32_t blend_565_pixel(const uint32_t pixel, const struct fb_blend *b) {
+	const uint32_t spread = ((pixel | pixel << 16) & 0x07e0f81f) * (32 - b->alpha5) + b->spread;
+	const uint32_t blended = spread >> 5 & 0x07e0f81f;
+	return (blended | blended >> 16) & 0xffff;
+}
+
+static inline u32x4 blend_565_pixels(const u32x4 pixels, const struct fb_blend *b) {
+	const u32x4 spread = ((pixels | pixels << 16) & 0x07e0f81f) * (32 - b->alpha5) + b->spread;
+	const u32x4 blended = spread >> 5 & 0x07e0f81f;
+	return (blended | blended >> 16) & 0xffff;
+}
+
+static void blend_565(const struct fb *fb, uint8_t *out, const struct fb_blend *b,
+		const size_t n) {
+	(void)fb;
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		u16x4 halves;
+		memcpy(&halves, out + 2 * i, sizeof(halves));
+		halves = u32x4_to_u16x4(blend_565_pixels(u16x4_to_u32x4(halves), b));
+		memcpy(out + 2 * i, &halves, sizeof(halves));
+	}
+	for (; i < n; i++) {
+		uint16_t pixel;
+		memcpy(&pixel, out + 2 * i, sizeof(pixel));
+		pixel = blend_565_pixel(pixel, b);
+		memcpy(out + 2 * i, &pixel, sizeof(pixel));
+	}
+}
+
+/* Blends any other layout one pixel at a time, through 24-bit rgb */
+static void blend_any(const struct fb *fb, uint8_t *out, const struct fb_blend *b,
+		const size_t n) {
+	const uint32_t keep = 256 - b->alpha;
+	for (size_t i = 0; i < n; i++, out += fb->depth) {
+		uint32_t pixel = 0;
+		memcpy(&pixel, out, fb->depth);
+		uint32_t rgb = 0;
+		for (int c = 0; c < 3; c++) {
+			const struct fb_channel *channel = &fb->format.channels[c];
+			uint32_t value = pixel >> channel->offset & ((1U << channel->length) - 1);
+			value = channel->length >= 8 ? value >> (channel->length - 8) :
+				value << (8 - channel->length);
+			const uint32_t source = b->color >> (16 - 8 * c) & 0xff;
+			rgb |= (value * keep + source * b->alpha) >> 8 << (16 - 8 * c);
+		}
+		pixel = fb_pack(fb, rgb);
+		memcpy(out, &pixel, fb->depth);
+	}
+}
+
+/*
+ * Describes fb's pixel layout from vinfo and picks kernels for its size.
+ * Palette based 8-bit screens are assumed to be set up as 3:3:2 rgb.
+ * Expects line_len and threads to be set.
+ */
+static int fb_select_kernels(struct fb *fb) {
+	const struct fb_var_screeninfo *vinfo = &fb->vinfo;
+	const struct fb_bitfield *bitfields[3] = {&vinfo->red, &vinfo->green, &vinfo->blue};
+	static const struct fb_channel rgb332[3] = {{5, 3}, {2, 3}, {0, 2}};
+	fb->depth = (vinfo->bits_per_pixel + 7) / 8;
+	for (int i = 0; i < 3; i++) {
+		fb->format.channels[i].offset = bitfields[i]->offset;
+		fb->format.channels[i].length = bitfields[i]->length;
+		if (vinfo->bits_per_pixel == 8 && bitfields[i]->length == 0) {
+			fb->format.channels[i] = rgb332[i];
+		}
+	}
+	fb->format.opaque = vinfo->transp.length == 0 || vinfo->transp.length >= 32 ? 0 :
+		((1U << vinfo->transp.length) - 1) << vinfo->transp.offset;
+	switch (vinfo->bits_per_pixel) {
+	case 8:
+		fb->fill = fill_8;
+		fb->span = span_8;
+		break;
+	case 16:
+		fb->fill = fill_16;
+		fb->span = span_16;
+		break;
+	case 24:
+		fb->fill = fill_24;
+		fb->span = span_24;
+		break;
+	case 32:
+		fb->fill = fill_32;
+		fb->span = span_32;
+		break;
+	default:
+		fprintf(stderr, "Cannot handle bit depth of %u\n", vinfo->bits_per_pixel);
+		return EXIT_FAILURE;
+	}
+	const struct fb_channel *channels = fb->format.channels;
+	fb->blend = blend_any;
+	if (fb->depth == 2 && channels[1].offset == 5 && channels[1].length == 6 &&
+			channels[0].length == 5 && channels[2].length == 5 &&
+			channels[0].offset + channels[2].offset == 11) {
+		/* rgb or bgr, blended alike */
+		fb->blend = blend_565;
+	} else if (fb->depth == 4 && channels[0].length == 8 && channels[1].length == 8 &&
+			channels[2].length == 8 && channels[0].offset % 8 == 0 &&
+			channels[1].offset % 8 == 0 && channels[2].offset % 8 == 0) {
+		fb->blend = blend_8888;
+	}
+	fb->rows = malloc((size_t)fb->line_len * (fb->threads > 1 ? fb->threads : 1));
+	if (fb->rows == NULL) {
+		perror("Could not allocate scratch row");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/* Areas with fewer bytes than this are drawn on the calling thread only */
+#define FB_PARALLEL_MIN (256 * 1024)
+#define FB_THREADS_MAX 16
+
+/* Draws rows [y0, y1) of a job, using scratch line of band */
+typedef void fb_band_func(struct fb *fb, void *job, int band, int y0, int y1);
+
+#ifdef HAVE_PTHREAD
+struct fb_worker {
+	struct fb_pool *pool;
+	int band;
+	pthread_t thread;
+};
+
+/*
+ * Threads kept for fb's lifetime, each drawing its band of every job.
+ * Band 0 is drawn by the thread handing the job out.
+ */
+struct fb_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t start; /* new job or quit */
+	pthread_cond_t done; /* last band of job finished */
+	unsigned int job_no;
+	int pending; /* bands still being drawn by workers */
+	bool quit;
+	fb_band_func *func;
+	struct fb *fb;
+	void *job;
+	int band_y[FB_THREADS_MAX + 1]; /* bands are rows [band_y[i], band_y[i + 1]) */
+	int workers;
+	struct fb_worker worker[FB_THREADS_MAX - 1];
+};
+
+static void *fb_worker_run(void *arg) {
+	struct fb_worker *worker = arg;
+	struct fb_pool *pool = worker->pool;
+	unsigned int job_no = 0;
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->quit && pool->job_no == job_no) {
+			pthread_cond_wait(&pool->start, &pool->lock);
+		}
+		if (pool->quit) {
+			break;
+		}
+		job_no = pool->job_no;
+		const int y0 = pool->band_y[worker->band];
+		const int y1 = pool->band_y[worker->band + 1];
+		pthread_mutex_unlock(&pool->lock);
+		if (y1 > y0) {
+			pool->func(pool->fb, pool->job, worker->band, y0, y1);
+		}
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->pending == 0) {
+			pthread_cond_signal(&pool->done);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+static void fb_pool_free(struct fb_pool *pool) {
+	if (pool == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = true;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+	for (int i = 0; i < pool->workers; i++) {
+		pthread_join(pool->worker[i].thread, NULL);
+	}
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->start);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+/* Starts fb->threads - 1 workers, drawing stays on the calling thread if it can't */
+static void fb_pool_start(struct fb *fb) {
+	if (fb->threads > FB_THREADS_MAX) {
+		fb->threads = FB_THREADS_MAX;
+	}
+	if (fb->threads <= 1) {
+		return;
+	}
+	struct fb_pool *pool = calloc(1, sizeof(*pool));
+	if (pool == NULL) {
+		perror("Could not allocate worker pool");
+		fb->threads = 1;
+		return;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	for (; pool->workers < fb->threads - 1; pool->workers++) {
+		struct fb_worker *worker = &pool->worker[pool->workers];
+		worker->pool = pool;
+		worker->band = pool->workers + 1;
+		if (pthread_create(&worker->thread, NULL, fb_worker_run, worker) != 0) {
+			perror("Could not start worker thread");
+			break;
+		}
+	}
+	fb->threads = pool->workers + 1;
+	fb->pool = pool;
+}
+#else
+struct fb_pool;
+
+static void fb_pool_free(struct fb_pool *pool) {
+	(void)pool;
+}
+
+static void fb_pool_start(struct fb *fb) {
+	if (fb->threads > 1) {
+		fputs("Built without thread support, drawing on one thread\n", stderr);
+	}
+	fb->threads = 1;
+}
+#endif
+
+/* Returns scratch line of band, see fb_select_kernels() */
+static void *fb_scratch(const struct fb *fb, const int band) {
+	return (uint8_t *)fb->rows + (size_t)band * fb->line_len;
+}
+
+/*
+ * Draws job over screen rows [y, y + height), in which it writes about bytes.
+ * Large jobs are split into one band per thread, with band borders on
+ * rows starting at a cache line, so no two threads write the same line.
+ */
+static void fb_parallel(struct fb *fb, const int y, const int height,
+		const size_t bytes, fb_band_func *func, void *job) {
+#ifdef HAVE_PTHREAD
+	struct fb_pool *pool = fb->pool;
+	if (pool != NULL && bytes >= FB_PARALLEL_MIN) {
+		const int bands = pool->workers + 1;
+		/* rows between cache line aligned ones */
+		const uint32_t line_bits = fb->line_len & -fb->line_len;
+		const int step = line_bits >= 64 ? 1 : 64 / line_bits;
+		pthread_mutex_lock(&pool->lock);
+		pool->band_y[0] = y;
+		for (int i = 1; i < bands; i++) {
+			const int band_y = y + (int)((int64_t)height * i / bands);
+			const int aligned = band_y - band_y % step;
+			pool->band_y[i] = aligned > pool->band_y[i - 1] ? aligned : pool->band_y[i - 1];
+		}
+		pool->band_y[bands] = y + height;
+		pool->func = func;
+		pool->fb = fb;
+		pool->job = job;
+		pool->pending = pool->workers;
+		++pool->job_no;
+		pthread_cond_broadcast(&pool->start);
+		pthread_mutex_unlock(&pool->lock);
+		if (pool->band_y[1] > y) {
+			func(fb, job, 0, y, pool->band_y[1]);
+		}
+		pthread_mutex_lock(&pool->lock);
+		while (pool->pending > 0) {
+			pthread_cond_wait(&pool->done, &pool->lock);
+		}
+		pthread_mutex_unlock(&pool->lock);
+		return;
+	}
+#else
+	(void)bytes;
+#endif
+	func(fb, job, 0, y, y + height);
+}
+
+#define NONPRINTABLE 0xffc399bdbd99c3ffL
+
+static const uint64_t alphabet[256] = {
+	NONPRINTABLE, NONPRINTABLE, NONPRINTABLE, NONPRINTABLE,
+	NONPRINTABLE, NONPRINTABLE, NONPRINTABLE, NONPRINTABLE,
+	NONPRINTABLE,/*\n*/NONPRINTABLE, NONPRINTABLE, NONPRINTABLE,
+	NONPRINTABLE, NONPRINTABLE, NONPRINTABLE, NONPRINTABLE,
+	NONPRINTABLE, NONPRINTABLE, NONPRINTABLE, NONPRINTABLE,
+	NONPRINTABLE, NONPRINTABLE, NONPRINTABLE, NONPRINTABLE,
+	NONPRINTABLE, NONPRINTABLE, NONPRINTABLE, NONPRINTABLE,
+	NONPRINTABLE, NONPRINTABLE, NONPRINTABLE, NONPRINTABLE,
+	/*space*/0,          0x000c000c1e1e1e0cL, 0x0000000000363636L, 0x0036367f367f3636L,
+	0x000c1f301e033e0cL, 0x0063660c18336300L, 0x006e333b6e1c361cL, 0x0000000000030606L,
+	0x00180c0606060c18L, 0x00060c1818180c06L, 0x0000663cff3c6600L, 0x00000c0c3f0c0c00L,
+	0x060c0c0000000000L, 0x000000003f000000L, 0x000c0c0000000000L, 0x000103060c183060L,
+	/*0*/0x3e676f7b73633eL,0x3f0c0c0c0c0e0cL, 0x003f33061c30331eL, 0x001e33301c30331eL,
+	0x0078307f33363c38L, 0x001e3330301f033fL, 0x001e33331f03061cL, 0x000c0c0c1830333fL,
+	0x001e33331e33331eL, 0x000e18303e33331eL, 0x000c0c00000c0c00L, 0x060c0c00000c0c00L,
+	0x00180c0603060c18L, 0x00003f00003f0000L, 0x00060c1830180c06L, 0x000c000c1830331eL,
+	0x1e037b7b7b633eL,/*A*/0x33333f33331e0cL, 0x003f66663e66663fL, 0x003c66030303663cL,
+	0x001f36666666361fL, 0x007e06061e06067eL, 0x000606061e06067eL, 0x007c66730303663cL,
+	0x003333333f333333L, 0x001e0c0c0c0c0c1eL, 0x001e333330303078L, 0x006766361e366667L,
+	0x007e060606060606L, 0x0063636b7f7f7763L, 0x006363737b6f6763L, 0x001c36636363361cL,
+	0x000f06063e66663fL, 0x00381e3b3333331eL, 0x006766363e66663fL, 0x001e33380e07331eL,
+	0x000c0c0c0c0c0c3fL, 0x003f333333333333L, 0x000c1e3333333333L, 0x0063777f6b636363L,
+	0x0063361c1c366363L, 0x001e0c0c1e333333L, 0x007f060c1830607fL, 0x001e06060606061eL,
+	0x00406030180c0603L, 0x001e18181818181eL, 0x0000000063361c08L, 0xff00000000000000L,
+	0x000000180c0cL,/*a*/0x006e333e301e0000L, 0x003b66663e060607L, 0x001e3303331e0000L,
+	0x006e33333e303038L, 0x001e033f331e0000L, 0x000f06060f06361cL, 0x1f303e33336e0000L,
+	0x006766666e360607L, 0x001e0c0c0c0e000cL, 0x1e33333030300030L, 0x0067361e36660607L,
+	0x001e0c0c0c0c0c0eL, 0x00636b7f7f330000L, 0x00333333331f0000L, 0x001e3333331e0000L,
+	0x0f063e66663b0000L, 0x78303e33336e0000L, 0x000f06666e3b0000L, 0x001f301e033e0000L,
+	0x00182c0c0c3e0c08L, 0x006e333333330000L, 0x000c1e3333330000L, 0x00367f7f6b630000L,
+	0x0063361c36630000L, 0x1f303e3333330000L, 0x003f260c193f0000L, 0x00380c0c070c0c38L,
+	0x0018181800181818L, 0x00070c0c380c0c07L, 0x0000000000003b6eL, NONPRINTABLE,
+	/* TODO: add higher 128 chars? But what encoding? */
+};
+
+/* Position of a character in font's unicode table */
+struct font_char {
+	uint32_t code;
+	uint32_t glyph;
+};
+
+/*
+ * Console font, the built-in 8x8 one or a PSF1/PSF2 file mapped read-only.
+ * Glyph rows are read straight from the mapping, most significant bit
+ * being the leftmost pixel.
+ */
+struct fb_font {
+	char *path; /* NULL for built-in font */
+	void *map;
+	size_t map_size;
+	int width; /* glyph cell size in px */
+	int height;
+	unsigned int glyph_count;
+	size_t row_bytes; /* bytes per glyph row */
+	size_t glyph_size; /* bytes per glyph */
+	const uint8_t *glyphs; /* NULL for built-in font */
+	struct font_char *chars; /* unicode table sorted by code, NULL if none */
+	size_t char_count;
+	unsigned int fallback; /* glyph for characters font lacks */
+};
+
+/* Built-in font, glyphs are indexed by Latin-1 code */
+static const struct fb_font builtin_font = {
+	NULL, NULL, 0, 8, 8, 256, 1, 8, NULL, NULL, 0, 0
+};
+
+#define PSF1_MAGIC 0x0436
+#define PSF1_MODE512 0x01
+#define PSF1_MODEHASTAB 0x02
+#define PSF1_MODEHASSEQ 0x04
+#define PSF1_SEPARATOR 0xffff
+#define PSF1_STARTSEQ 0xfffe
+#define PSF2_MAGIC 0x864ab572
+#define PSF2_HAS_UNICODE_TABLE 0x01
+#define PSF2_SEPARATOR 0xff
+#define PSF2_STARTSEQ 0xfe
+
+static uint32_t read_le32(const uint8_t *p) {
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/*
+ * Decodes UTF-8 character at *s and advances *s past it. Bytes that don't
+ * start a valid sequence are taken as Latin-1, as text always was before.
+ */
+static uint32_t utf8_next(const char **s) {
+	const uint8_t *p = (const uint8_t *)*s;
+	uint32_t code = p[0];
+	uint32_t min = 0;
+	int extra = 0;
+	if (code >= 0xc2 && code <= 0xdf) {
+		extra = 1;
+		code &= 0x1f;
+		min = 0x80;
+	} else if (code >= 0xe0 && code <= 0xef) {
+		extra = 2;
+		code &= 0x0f;
+		min = 0x800;
+	} else if (code >= 0xf0 && code <= 0xf4) {
+		extra = 3;
+		code &= 0x07;
+		min = 0x10000;
+	}
+	for (int i = 1; i <= extra; i++) {
+		if ((p[i] & 0xc0) != 0x80) {
+			extra = -1;
+			break;
+		}
+		code = code << 6 | (p[i] & 0x3f);
+	}
+	if (extra < 0 || code < min || code > 0x10ffff || (code >= 0xd800 && code <= 0xdfff)) {
+		*s += 1;
+		return p[0];
+	}
+	*s += 1 + extra;
+	return code;
+}
+
+/* Returns number of characters in UTF-8 text */
+static size_t utf8_length(const char *text) {
+	size_t len = 0;
+	while (*text) {
+		utf8_next(&text);
+		++len;
+	}
+	return len;
+}
+
+static int font_char_compare(const void *a, const void *b) {
+	const uint32_t code_a = ((const struct font_char *)a)->code;
+	const uint32_t code_b = ((const struct font_char *)b)->code;
+	return code_a < code_b ? -1 : code_a > code_b;
+}
+
+/* Looks code up in font's unicode table, or takes it as glyph index if there's none */
+static bool font_find(const struct fb_font *font, const uint32_t code, unsigned int *glyph) {
+	if (font->chars == NULL) {
+		*glyph = code;
+		return code < font->glyph_count;
+	}
+	const struct font_char key = {code, 0};
+	const struct font_char *found = bsearch(&key, font->chars, font->char_count,
+		sizeof(key), font_char_compare);
+	if (found != NULL) {
+		*glyph = found->glyph;
+	}
+	return found != NULL;
+}
+
+static unsigned int font_glyph(const struct fb_font *font, const uint32_t code) {
+	unsigned int glyph;
+	return font_find(font, code, &glyph) ? glyph : font->fallback;
+}
+
+static bool font_add_char(struct fb_font *font, size_t *capacity,
+		const uint32_t code, const unsigned int glyph) {
+	if (font->char_count == *capacity) {
+		*capacity = *capacity ? 2 * *capacity : 256;
+		struct font_char *chars = realloc(font->chars, *capacity * sizeof(*chars));
+		if (chars == NULL) {
+			return false;
+		}
+		font->chars = chars;
+	}
+	font->chars[font->char_count].code = code;
+	font->chars[font->char_count].glyph = glyph;
+	++font->char_count;
+	return true;
+}
+
+/*
+ * Collects single characters of unicode table starting at p, skipping
+ * character sequences, which can't be drawn as one glyph anyway.
+ */
+static bool font_read_table(struct fb_font *font, const uint8_t *p, const uint8_t *end,
+		const bool psf2) {
+	size_t capacity = 0;
+	for (unsigned int glyph = 0; glyph < font->glyph_count && p < end; glyph++) {
+		bool sequences = false;
+		while (p < end) {
+			uint32_t code;
+			if (psf2) {
+				if (*p == PSF2_SEPARATOR || *p == PSF2_STARTSEQ) {
+					sequences |= *p == PSF2_STARTSEQ;
+					if (*p++ == PSF2_SEPARATOR) {
+						break;
+					}
+					continue;
+				}
+				/* decode from a terminated copy, the table may end mid-sequence */
+				char buf[5] = {0};
+				memcpy(buf, p, end - p < 4 ? (size_t)(end - p) : 4);
+				const char *next = buf;
+				code = utf8_next(&next);
+				p += next - buf;
+			} else {
+				if (end - p < 2) {
+					p = end;
+					break;
+				}
+				code = p[0] | p[1] << 8;
+				p += 2;
+				if (code == PSF1_SEPARATOR) {
+					break;
+				} else if (code == PSF1_STARTSEQ) {
+					sequences = true;
+					continue;
+				}
+			}
+			if (!sequences && !font_add_char(font, &capacity, code, glyph)) {
+				return false;
+			}
+		}
+	}
+	qsort(font->chars, font->char_count, sizeof(*font->chars), font_char_compare);
+	return true;
+}
+
+static void font_free(struct fb_font *font) {
+	if (font == NULL) {
+		return;
+	}
+	if (font->map != NULL && font->map != MAP_FAILED) {
+		munmap(font->map, font->map_size);
+	}
+	free(font->chars);
+	free(font->path);
+	free(font);
+}
+
+/* Maps PSF1 or PSF2 font file and indexes its unicode table */
+static struct fb_font *font_load(const char *path) {
+	struct fb_font *font = calloc(1, sizeof(*font));
+	if (font == NULL || (font->path = strdup(path)) == NULL) {
+		perror("Could not allocate font");
+		free(font);
+		return NULL;
+	}
+	const int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		perror("Could not open font");
+		if (fd >= 0) {
+			close(fd);
+		}
+		font_free(font);
+		return NULL;
+	}
+	font->map_size = st.st_size;
+	font->map = font->map_size ? mmap(0, font->map_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+	close(fd);
+	if (font->map == MAP_FAILED) {
+		perror("Could not mmap font");
+		font_free(font);
+		return NULL;
+	}
+	const uint8_t *data = font->map;
+	const size_t size = font->map_size;
+	size_t header_size = 0;
+	size_t glyph_size = 0;
+	bool has_table = false;
+	bool psf2 = false;
+	if (size >= 4 && (data[0] | data[1] << 8) == PSF1_MAGIC) {
+		header_size = 4;
+		font->width = 8;
+		font->height = data[3];
+		font->glyph_count = data[2] & PSF1_MODE512 ? 512 : 256;
+		glyph_size = data[3];
+		has_table = data[2] & (PSF1_MODEHASTAB | PSF1_MODEHASSEQ);
+	} else if (size >= 32 && read_le32(data) == PSF2_MAGIC) {
+		psf2 = true;
+		header_size = read_le32(data + 8);
+		has_table = read_le32(data + 12) & PSF2_HAS_UNICODE_TABLE;
+		font->glyph_count = read_le32(data + 16);
+		glyph_size = read_le32(data + 20);
+		font->height = read_le32(data + 24);
+		font->width = read_le32(data + 28);
+	} else {
+		fputs("Unknown font format, expected PSF1 or PSF2\n", stderr);
+		font_free(font);
+		return NULL;
+	}
+	font->row_bytes = (font->width + 7) / 8;
+	font->glyph_size = font->row_bytes * font->height;
+	/* glyph rows are handled as 32-bit masks */
+	if (font->width < 1 || font->width > 32 || font->height < 1 ||
+			font->glyph_count == 0 || glyph_size != font->glyph_size ||
+			header_size > size ||
+			(size - header_size) / glyph_size < font->glyph_count) {
+		fputs("Unsupported or truncated font\n", stderr);
+		font_free(font);
+		return NULL;
+	}
+	font->glyphs = data + header_size;
+	const uint8_t *table = font->glyphs + font->glyph_count * glyph_size;
+	if (has_table && !font_read_table(font, table, data + size, psf2)) {
+		perror("Could not index font");
+		font_free(font);
+		return NULL;
+	}
+	if (!font_find(font, 0xfffd, &font->fallback) && !font_find(font, '?', &font->fallback)) {
+		font->fallback = 0;
+	}
+	return font;
+}
+
+/* Returns font used for text on fb */
+static const struct fb_font *fb_font(const struct fb *fb) {
+	return fb->font != NULL ? fb->font : &builtin_font;
+}
+
+/* Returns row of glyph as mask, least significant bit being the leftmost pixel */
+static uint32_t font_row(const struct fb_font *font, const unsigned int glyph, const int ly) {
+	if (font->glyphs == NULL) {
+		return alphabet[glyph] >> (ly * 8) & 0xff;
+	}
+	const uint8_t *in = font->glyphs + glyph * font->glyph_size + ly * font->row_bytes;
+	uint32_t bits = 0;
+	for (size_t i = 0; i < font->row_bytes; i++) {
+		uint8_t b = in[i];
+		b = (b & 0xf0) >> 4 | (b & 0x0f) << 4;
+		b = (b & 0xcc) >> 2 | (b & 0x33) << 2;
+		b = (b & 0xaa) >> 1 | (b & 0x55) << 1;
+		bits |= (uint32_t)b << (8 * i);
+	}
+	return font->width == 32 ? bits : bits & ((1U << font->width) - 1);
+}
+
+/*
+ * Glyphs expanded to screen pixels for current font, scale and color pair.
+ * Glyphs get packed one after another into a single atlas on first use.
+ * Each atlas slot holds the glyph's row masks, for drawing foreground only,
+ * and its rows as row_size ready-to-store bytes, assembled from the 16
+ * precomputed nibble patterns. The atlas is rebuilt when scale or colors
+ * change and dropped along with the font.
+ */
+struct glyph_cache {
+	int scale;
+	uint32_t fg_color;
+	uint32_t bg_color;
+	struct fb_blend fg_blend; /* for drawing translucent colors by blending */
+	struct fb_blend bg_blend;
+	int height; /* rows per glyph */
+	size_t cell_size; /* bytes per scaled glyph pixel */
+	size_t row_size; /* bytes per scaled glyph row */
+	uint8_t *fg; /* row_size bytes of foreground color */
+	uint8_t *nibbles; /* 16 patterns, 4 * cell_size bytes each */
+	uint32_t *slots; /* 1 + atlas slot of each font glyph, 0 until used */
+	uint32_t *masks; /* height row masks per slot */
+	uint8_t *pixels; /* height rows of row_size bytes per slot */
+	unsigned int count; /* slots used */
+	unsigned int capacity;
+};
+
+static void glyph_cache_free(struct glyph_cache *cache) {
+	if (cache == NULL) {
+		return;
+	}
+	free(cache->fg);
+	free(cache->nibbles);
+	free(cache->slots);
+	free(cache->masks);
+	free(cache->pixels);
+	free(cache);
+}
+
+/* Returns fb's glyph cache for given scale and colors, (re)building it */
+static struct glyph_cache *glyph_cache_get(struct fb *fb, const int scale,
+		const uint32_t bg_color, const uint32_t fg_color) {
+	struct glyph_cache *cache = fb->glyphs;
+	if (cache != NULL && cache->scale == scale &&
+			cache->bg_color == bg_color && cache->fg_color == fg_color) {
+		return cache;
+	}
+	const struct fb_font *font = fb_font(fb);
+	glyph_cache_free(cache);
+	fb->glyphs = cache = calloc(1, sizeof(*cache));
+	if (cache == NULL) {
+		perror("Could not allocate glyph cache");
+		return NULL;
+	}
+	cache->scale = scale;
+	cache->bg_color = bg_color;
+	cache->fg_color = fg_color;
+	blend_prepare(fb, &cache->fg_blend, fg_color);
+	blend_prepare(fb, &cache->bg_blend, bg_color);
+	cache->height = font->height;
+	cache->cell_size = (size_t)scale * fb->depth;
+	cache->row_size = font->width * cache->cell_size;
+	cache->fg = malloc(cache->row_size);
+	uint8_t *bg = malloc(cache->cell_size);
+	cache->nibbles = malloc(16 * 4 * cache->cell_size);
+	cache->slots = calloc(font->glyph_count, sizeof(*cache->slots));
+	if (cache->fg == NULL || bg == NULL || cache->nibbles == NULL || cache->slots == NULL) {
+		perror("Could not allocate glyph cache");
+		free(bg);
+		glyph_cache_free(cache);
+		fb->glyphs = NULL;
+		return NULL;
+	}
+	fb->span(cache->fg, fb_pack(fb, fg_color), (size_t)font->width * scale);
+	fb->span(bg, fb_pack(fb, bg_color), scale);
+	/* Least significant bit is the leftmost pixel */
+	uint8_t *out = cache->nibbles;
+	for (int nibble = 0; nibble < 16; nibble++) {
+		for (int bit = 0; bit < 4; bit++) {
+			memcpy(out, nibble >> bit & 1 ? cache->fg : bg, cache->cell_size);
+			out += cache->cell_size;
+		}
+	}
+	free(bg);
+	return cache;
+}
+
+/* Returns atlas slot of glyph, expanding it on first use, or -1 */
+static int glyph_cache_slot(struct glyph_cache *cache, const struct fb_font *font,
+		const unsigned int glyph) {
+	if (cache->slots[glyph] != 0) {
+		return cache->slots[glyph] - 1;
+	}
+	if (cache->count == cache->capacity) {
+		const unsigned int capacity = cache->capacity ? 2 * cache->capacity : 64;
+		uint32_t *masks = realloc(cache->masks,
+			(size_t)capacity * cache->height * sizeof(*masks));
+		if (masks != NULL) {
+			cache->masks = masks;
+		}
+		uint8_t *pixels = realloc(cache->pixels,
+			(size_t)capacity * cache->height * cache->row_size);
+		if (masks == NULL || pixels == NULL) {
+			perror("Could not allocate glyph cache");
+			return -1;
+		}
+		cache->pixels = pixels;
+		cache->capacity = capacity;
+	}
+	const unsigned int slot = cache->count++;
+	uint32_t *masks = cache->masks + (size_t)slot * cache->height;
+	uint8_t *out = cache->pixels + (size_t)slot * cache->height * cache->row_size;
+	const size_t half = 4 * cache->cell_size;
+	for (int ly = 0; ly < cache->height; ++ly) {
+		const uint32_t bits = masks[ly] = font_row(font, glyph, ly);
+		for (int lx = 0; lx < font->width; lx += 4) {
+			const int cells = font->width - lx < 4 ? font->width - lx : 4;
+			memcpy(out + lx * cache->cell_size,
+				cache->nibbles + (bits >> lx & 0xf) * half, cells * cache->cell_size);
+		}
+		out += cache->row_size;
+	}
+	cache->slots[glyph] = slot + 1;
+	return slot;
+}
+
+/*
+ * Draws scaled rows [from, to) of glyph in atlas slot with background,
+ * storing whole rows. out points at glyph's top left corner.
+ */
+static void draw_glyph_opaque(const struct fb *fb, const struct glyph_cache *cache,
+		uint8_t *out, const int slot, const int from, const int to) {
+	const uint8_t *rows = cache->pixels + (size_t)slot * cache->height * cache->row_size;
+	out += (size_t)from * fb->line_len;
+	for (int sy = from; sy < to; ++sy) {
+		memcpy(out, rows + sy / cache->scale * cache->row_size, cache->row_size);
+		out += fb->line_len;
+	}
+}
+
+/*
+ * Draws foreground of scaled rows [from, to) of glyph in atlas slot only,
+ * one store per run of set bits. out points at glyph's top left corner.
+ */
+static void draw_glyph_transparent(const struct fb *fb,
+		const struct glyph_cache *cache, uint8_t *out, const int slot,
+		const int from, const int to) {
+	const uint32_t *masks = cache->masks + (size_t)slot * cache->height;
+	for (int ly = from / cache->scale; ly * cache->scale < to; ++ly) {
+		const int row_from = ly * cache->scale > from ? ly * cache->scale : from;
+		const int row_to = (ly + 1) * cache->scale < to ? (ly + 1) * cache->scale : to;
+		uint8_t *row_out = out + (size_t)row_from * fb->line_len;
+		uint64_t bits = masks[ly];
+		while (bits != 0) {
+			const int start = __builtin_ctzll(bits);
+			const int run = __builtin_ctzll(~(bits >> start));
+			const size_t offset = start * cache->cell_size;
+			const size_t size = run * cache->cell_size;
+			uint8_t *run_out = row_out + offset;
+			for (int sy = row_from; sy < row_to; ++sy) {
+				memcpy(run_out, cache->fg, size);
+				run_out += fb->line_len;
+			}
+			bits &= ~(((UINT64_C(1) << run) - 1) << start);
+		}
+	}
+}
+
+/*
+ * Draws scaled rows [from, to) of glyph in atlas slot with colors that
+ * may be translucent, blending each run of foreground and, if bg_clear,
+ * background pixels into the screen. out points at glyph's top left corner.
+ */
+static void draw_glyph_blend(const struct fb *fb, const struct glyph_cache *cache,
+		uint8_t *out, const int slot, const int from, const int to, const bool bg_clear) {
+	const uint32_t *masks = cache->masks + (size_t)slot * cache->height;
+	const int width = cache->row_size / cache->cell_size;
+	for (int ly = from / cache->scale; ly * cache->scale < to; ++ly) {
+		const int row_from = ly * cache->scale > from ? ly * cache->scale : from;
+		const int row_to = (ly + 1) * cache->scale < to ? (ly + 1) * cache->scale : to;
+		const uint32_t bits = masks[ly];
+		for (int start = 0, end = 0; start < width; start = end) {
+			const uint32_t fg = bits >> start & 1;
+			end = start + 1;
+			while (end < width && (bits >> end & 1) == fg) {
+				end++;
+			}
+			if (!fg && !bg_clear) {
+				continue;
+			}
+			const struct fb_blend *color = fg ? &cache->fg_blend : &cache->bg_blend;
+			const size_t n = (size_t)(end - start) * cache->scale;
+			uint8_t *run_out = out + (size_t)row_from * fb->line_len + start * cache->cell_size;
+			for (int sy = row_from; sy < row_to; ++sy) {
+				if (color->alpha == 256) {
+					fb->span(run_out, color->pixel, n);
+				} else {
+					fb->blend(fb, run_out, color, n);
+				}
+				run_out += fb->line_len;
+			}
+		}
+	}
+}
+
+/* Glyph laid out on screen */
+struct text_glyph {
+	int x;
+	int y;
+	int slot;
+};
+
+/* Laid out text, drawn band by band */
+struct text_job {
+	const struct glyph_cache *cache;
+	const struct text_glyph *glyphs;
+	size_t count;
+	int letter_height;
+	bool bg_clear;
+};
+
+static void text_band(struct fb *fb, void *arg, const int band, const int y0, const int y1) {
+	const struct text_job *job = arg;
+	(void)band;
+	for (size_t i = 0; i < job->count; i++) {
+		const struct text_glyph *glyph = &job->glyphs[i];
+		const int from = y0 > glyph->y ? y0 - glyph->y : 0;
+		const int to = y1 < glyph->y + job->letter_height ?
+			y1 - glyph->y : job->letter_height;
+		if (from >= to) {
+			continue;
+		}
+		uint8_t *out = (uint8_t *)fb->mem +
+			(size_t)glyph->y * fb->line_len + (size_t)glyph->x * fb->depth;
+		if (job->cache->fg_blend.alpha < 256 ||
+				(job->bg_clear && job->cache->bg_blend.alpha < 256)) {
+			draw_glyph_blend(fb, job->cache, out, glyph->slot, from, to, job->bg_clear);
+		} else if (job->bg_clear) {
+			draw_glyph_opaque(fb, job->cache, out, glyph->slot, from, to);
+		} else {
+			draw_glyph_transparent(fb, job->cache, out, glyph->slot, from, to);
+		}
+	}
+}
+
+static void text_rows_free(struct fb *fb) {
+	if (fb->text_rows == NULL) {
+		return;
+	}
+	for (int i = 0; i < TEXT_ROWS_MAX; i++) {
+		free(fb->text_rows[i].cells);
+	}
+	free(fb->text_rows);
+	fb->text_rows = NULL;
+	fb->text_row_next = 0;
+}
+
+/*
+ * Returns remembered cells of text row with glyphs at y, starting over
+ * with all cells unknown when the row was laid out differently, e.g. at
+ * another scale or shifted by part of a cell. A new row replaces an unused
+ * one or, once TEXT_ROWS_MAX are in use, the oldest. Returns NULL if cells
+ * can't be remembered, so text is simply drawn.
+ */
+static struct text_row *text_row_get(struct fb *fb, const int y, const int height,
+		const int scale, const int cell_width, const int x) {
+	if (fb->text_rows == NULL &&
+			(fb->text_rows = calloc(TEXT_ROWS_MAX, sizeof(*fb->text_rows))) == NULL) {
+		return NULL;
+	}
+	struct text_row *row = NULL;
+	for (int i = 0; i < TEXT_ROWS_MAX && row == NULL; i++) {
+		if (fb->text_rows[i].cols > 0 && fb->text_rows[i].y == y) {
+			row = &fb->text_rows[i];
+		}
+	}
+	for (int i = 0; i < TEXT_ROWS_MAX && row == NULL; i++) {
+		if (fb->text_rows[i].cols == 0) {
+			row = &fb->text_rows[i];
+		}
+	}
+	if (row == NULL) {
+		row = &fb->text_rows[fb->text_row_next];
+		fb->text_row_next = (fb->text_row_next + 1) % TEXT_ROWS_MAX;
+	}
+	const int x0 = x % cell_width;
+	if (row->cols > 0 && row->y == y && row->height == height && row->scale == scale &&
+			row->cell_width == cell_width && row->x0 == x0) {
+		return row;
+	}
+	free(row->cells);
+	row->cols = 0;
+	row->cells = NULL;
+	const int cols = (fb->width - x0) / cell_width;
+	struct text_cell *cells = cols > 0 ? calloc(cols, sizeof(*cells)) : NULL;
+	if (cells == NULL) {
+		return NULL;
+	}
+	const struct text_row new_row = {y, height, scale, x0, cell_width, cols, cells};
+	*row = new_row;
+	return row;
+}
+
+static bool text_cell_same(const struct text_cell *cell, const struct text_cell *other) {
+	return cell->glyph == other->glyph && cell->fg_color == other->fg_color &&
+		cell->bg_color == other->bg_color && cell->bg_clear == other->bg_clear;
+}
+
+/*
+ * Makes font file at path, or built-in font for NULL, the one text is drawn
+ * with. A loaded font is kept while path stays the same.
+ */
+static int fb_set_font(struct fb *fb, const char *path) {
+	if (path == NULL ? fb->font == NULL :
+			fb->font != NULL && strcmp(fb->font->path, path) == 0) {
+		return EXIT_SUCCESS;
+	}
+	struct fb_font *font = NULL;
+	if (path != NULL && (font = font_load(path)) == NULL) {
+		return EXIT_FAILURE;
+	}
+	font_free(fb->font);
+	fb->font = font;
+	glyph_cache_free(fb->glyphs);
+	fb->glyphs = NULL;
+	/* remembered cells hold glyphs of the old font */
+	text_rows_free(fb);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Writes UTF-8 text on screen in cells of current font.
+ * Cells still showing the same glyph in the same colors since text was
+ * last written there are skipped, so rewriting a screen costs only the
+ * cells that change, see struct text_row.
+ * Known limitations:
+ *  - One glyph per character, combining sequences aren't composed.
+ *  - Doesn't handle \n for force line breaks.
+ *    Could be done, but complicates limits calculation and wrapping.
+ *  - Doesn't accept coordinates and alignment at the same time.
+ */
+static int fb_write_text(
+		struct fb *fb,
+		const char *text,
+		const int scale,
+		bool bg_clear,
+		const uint32_t bg_color,
+		const uint32_t fg_color,
+		int x,
+		int y,
+		const char *halign,
+		const char *valign) {
+	if (scale < 1) {
+		fputs("Invalid scale\n", stderr);
+		return EXIT_FAILURE;
+	}
+	const struct fb_font *font = fb_font(fb);
+	const unsigned int space_size = scale * 2;
+	const unsigned int letter_width = scale * font->width;
+	const unsigned int letter_height = scale * font->height;
+	const unsigned int max_chars_per_row = fb->width / letter_width;
+	const unsigned int row_height = space_size + letter_height;
+	const size_t len = utf8_length(text);
+
+	if (x != 0 && halign != NULL) {
+		fputs("You can't specify -H and -x at the same time\n", stderr);
+		return EXIT_FAILURE;
+	} else if (y != 0 && valign != NULL) {
+		fputs("You can't specify -V and -y at the same time\n", stderr);
+		return EXIT_FAILURE;
+	} else if (max_chars_per_row == 0) {
+		fputs("Text is too long\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	const unsigned int first_line_len = len > max_chars_per_row ? max_chars_per_row : len;
+	if (halign == NULL || strcmp(halign, "left") == 0) {
+		/* noop */
+	} else if (strcmp(halign, "right") == 0) {
+		x = fb->width - first_line_len * letter_width;
+	} else if (strcmp(halign, "center") == 0) {
+		x = (fb->width - first_line_len * letter_width) / 2;
+	} else {
+		fputs("Invalid horizontal alignment\n", stderr);
+		return EXIT_FAILURE;
+	}
+	const unsigned int rows_in_text = (len + max_chars_per_row - 1) / max_chars_per_row;
+	if (valign == NULL || strcmp(valign, "top") == 0) {
+		/* noop */
+	} else if (strcmp(valign, "center") == 0) {
+		y = (fb->height - row_height * rows_in_text) / 2;
+	} else if (strcmp(valign, "bottom") == 0) {
+		y = fb->height - row_height * rows_in_text;
+	} else {
+		fputs("Invalid vertical alignment\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	if (x < 0 || x > fb->width || y < 0 || y > fb->height) {
+		fputs("Out of screen bounds\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	const unsigned int max_rows = (fb->height - y) / row_height;
+	if (max_rows == 0 ||
+			len > (max_rows - 1) * max_chars_per_row + (fb->width - x) / letter_width) {
+		fputs("Text is too long\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	struct glyph_cache *cache = glyph_cache_get(fb, scale, bg_color, fg_color);
+	if (cache == NULL) {
+		return EXIT_FAILURE;
+	}
+	struct text_glyph *glyphs = malloc(len * sizeof(*glyphs));
+	if (glyphs == NULL && len > 0) {
+		perror("Could not allocate text layout");
+		return EXIT_FAILURE;
+	}
+	uint8_t *screen_out = (uint8_t *)fb->mem;
+	/* Pointer to left top letter corner */
+	uint8_t *letter_out = screen_out + fb->line_len * y + fb->depth * x;
+	unsigned int row = 0;
+	int row_x = x;
+	int row_chars = 0;
+	struct text_row *cells = NULL;
+	size_t count = 0;
+	/* Lay out chars in text that changed, drawing comes after */
+	for (size_t c = 0; c < len; ++c) {
+		const int glyph_x = row_x + row_chars * letter_width;
+		const int glyph_y = y + row_height * row;
+		const unsigned int glyph = font_glyph(font, utf8_next(&text));
+		if (row_chars == 0) {
+			cells = text_row_get(fb, glyph_y, letter_height, scale, letter_width, glyph_x);
+		}
+		const int col = cells != NULL ? (glyph_x - cells->x0) / letter_width : 0;
+		struct text_cell *cell = cells != NULL && col < cells->cols ?
+			&cells->cells[col] : NULL;
+		const struct text_cell drawn = {glyph + 1, fg_color, bg_clear ? bg_color : 0, bg_clear};
+		if (cell == NULL || !text_cell_same(cell, &drawn)) {
+			glyphs[count].x = glyph_x;
+			glyphs[count].y = glyph_y;
+			glyphs[count].slot = glyph_cache_slot(cache, font, glyph);
+			if (glyphs[count].slot < 0) {
+				/* forget cells remembered for glyphs that won't be drawn */
+				fb_damage(fb, 0, y, fb->width, glyph_y + letter_height - y);
+				free(glyphs);
+				return EXIT_FAILURE;
+			}
+			++count;
+			fb_damage(fb, glyph_x, glyph_y, letter_width, letter_height);
+			if (cell != NULL) {
+				*cell = drawn;
+			}
+		}
+		/* Advance to next letter in same row */
+		letter_out += fb->depth * letter_width;
+		++row_chars;
+		const int last_letter_in_row = fb->line_len * (y + row_height * row) +
+					       fb->depth * (fb->width - letter_width);
+		if (letter_out - screen_out > last_letter_in_row) {
+			++row;
+			letter_out = screen_out + fb->line_len * (y + row_height * row);
+			row_x = 0;
+			row_chars = 0;
+		}
+	}
+	if (count > 0) {
+		const int top = glyphs[0].y;
+		struct text_job job = {cache, glyphs, count, letter_height, bg_clear};
+		fb_parallel(fb, top, glyphs[count - 1].y + letter_height - top,
+			count * letter_width * letter_height * fb->depth, text_band, &job);
+	}
+	free(glyphs);
+	return EXIT_SUCCESS;
+}
+
+/* Square of pixels rotated at once, small enough to stay in L1 cache */
+#define ROTATE_TILE 32
+
+/* Moves area of a width x height plane to where it lands turned by angle */
+static void rect_rotate(struct fb_rect *area, const int angle, const int width,
+		const int height) {
+	const struct fb_rect upright = *area;
+	switch (angle) {
+	case 90:
+		area->x = height - upright.y - upright.height;
+		area->y = upright.x;
+		area->width = upright.height;
+		area->height = upright.width;
+		break;
+	case 180:
+		area->x = width - upright.x - upright.width;
+		area->y = height - upright.y - upright.height;
+		break;
+	case 270:
+		area->x = upright.y;
+		area->y = width - upright.x - upright.width;
+		area->width = upright.height;
+		area->height = upright.width;
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Stores rows of n pixels at out, line bytes apart, pixels read step bytes
+ * apart from in and rows row_step apart. Inlined with constant depth.
+ */
+static inline void rotate_tile(uint8_t *out, const size_t line, const uint8_t *in,
+		const ptrdiff_t step, const ptrdiff_t row_step, const int n, const int rows,
+		const uint32_t depth) {
+	for (int y = 0; y < rows; y++, out += line, in += row_step) {
+		const uint8_t *pixel = in;
+		for (int x = 0; x < n; x++, pixel += step) {
+			memcpy(out + (size_t)x * depth, pixel, depth);
+		}
+	}
+}
+
+/*
+ * Copies src turned clockwise by angle into area of dst. Goes through
+ * tiles of ROTATE_TILE rows of dst, so that dst, usually video memory, is
+ * stored row by row while the columns read from src stay cached.
+ */
+static void rotate_area(const struct fb_plane *dst, const struct fb_plane *src,
+		const struct fb_rect *area, const int angle, const uint32_t depth) {
+	/* source of the area's top left pixel and steps to its right and down */
+	int sx = area->x;
+	int sy = area->y;
+	ptrdiff_t step = depth;
+	ptrdiff_t row_step = src->line_len;
+	switch (angle) {
+	case 90:
+		sx = area->y;
+		sy = src->height - 1 - area->x;
+		step = -(ptrdiff_t)src->line_len;
+		row_step = depth;
+		break;
+	case 180:
+		sx = src->width - 1 - area->x;
+		sy = src->height - 1 - area->y;
+		step = -(ptrdiff_t)depth;
+		row_step = -(ptrdiff_t)src->line_len;
+		break;
+	case 270:
+		sx = src->width - 1 - area->y;
+		sy = area->x;
+		step = src->line_len;
+		row_step = -(ptrdiff_t)depth;
+		break;
+	default:
+		break;
+	}
+	const uint8_t *in = (const uint8_t *)src->mem + (size_t)sy * src->line_len +
+		(size_t)sx * depth;
+	for (int ty = 0; ty < area->height; ty += ROTATE_TILE) {
+		const int rows = area->height - ty < ROTATE_TILE ? area->height - ty : ROTATE_TILE;
+		for (int tx = 0; tx < area->width; tx += ROTATE_TILE) {
+			const int n = area->width - tx < ROTATE_TILE ? area->width - tx : ROTATE_TILE;
+			uint8_t *out = (uint8_t *)dst->mem + (size_t)(area->y + ty) * dst->line_len +
+				(size_t)(area->x + tx) * depth;
+			const uint8_t *tile = in + tx * step + ty * row_step;
+			switch (depth) {
+			case 1:
+				rotate_tile(out, dst->line_len, tile, step, row_step, n, rows, 1);
+				break;
+			case 2:
+				rotate_tile(out, dst->line_len, tile, step, row_step, n, rows, 2);
+				break;
+			case 3:
+				rotate_tile(out, dst->line_len, tile, step, row_step, n, rows, 3);
+				break;
+			default:
+				rotate_tile(out, dst->line_len, tile, step, row_step, n, rows, 4);
+				break;
+			}
+		}
+	}
+}
+
+/* Swaps buffer and geometry of fb with those of plane */
+static void fb_swap_plane(struct fb *fb, struct fb_plane *plane) {
+	const struct fb_plane drawn = {fb->mem, fb->size, fb->width, fb->height, fb->line_len};
+	fb->mem = plane->mem;
+	fb->size = plane->size;
+	fb->width = plane->width;
+	fb->height = plane->height;
+	fb->line_len = plane->line_len;
+	*plane = drawn;
+}
+
+/*
+ * Makes fb draw upright into a buffer of its own, seeded with what is on
+ * screen turned back, for fb_flush() to turn damaged areas onto the screen.
+ * Drawing code sees only the upright geometry.
+ */
+static int fb_rotate_init(struct fb *fb) {
+	const bool turned = fb->rotate != 180;
+	const int width = turned ? fb->height : fb->width;
+	const int height = turned ? fb->width : fb->height;
+	struct fb_plane upright = {NULL, (size_t)width * fb->depth * height,
+		width, height, width * fb->depth};
+	upright.mem = malloc(upright.size);
+	if (upright.mem == NULL) {
+		perror("Could not allocate rotated buffer");
+		return EXIT_FAILURE;
+	}
+	if (upright.line_len > fb->line_len) {
+		void *rows = realloc(fb->rows,
+			(size_t)upright.line_len * (fb->threads > 1 ? fb->threads : 1));
+		if (rows == NULL) {
+			perror("Could not allocate scratch row");
+			free(upright.mem);
+			return EXIT_FAILURE;
+		}
+		fb->rows = rows;
+	}
+	fb->screen = upright;
+	fb_swap_plane(fb, &fb->screen);
+	const struct fb_rect all = {0, 0, width, height};
+	rotate_area(&upright, &fb->screen, &all, 360 - fb->rotate, fb->depth);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Turns areas damaged in the upright buffer onto the screen buffer and
+ * damage into screen coordinates, which fb_flush() then presents.
+ */
+static void fb_rotate_damage(struct fb *fb) {
+	const struct fb_plane upright = {fb->mem, fb->size, fb->width, fb->height, fb->line_len};
+	if (fb->damage_count < 0) {
+		const struct fb_rect all = {0, 0, fb->screen.width, fb->screen.height};
+		rotate_area(&fb->screen, &upright, &all, fb->rotate, fb->depth);
+	}
+	for (int i = 0; i < fb->damage_count; i++) {
+		rect_rotate(&fb->damage[i], fb->rotate, fb->width, fb->height);
+		rotate_area(&fb->screen, &upright, &fb->damage[i], fb->rotate, fb->depth);
+	}
+}
+
+static void fb_destroy(struct fb *fb) {
+	if (fb->screen.mem != NULL) {
+		/* upright buffer goes, screen buffer is freed below */
+		free(fb->mem);
+		fb->mem = NULL;
+		fb_swap_plane(fb, &fb->screen);
+	}
+	if (fb->present == FB_PRESENT_FLIP && fb->page == 1 && fb->vmem != NULL &&
+			fb->vmem != MAP_FAILED) {
+		/* end on first page, which other modes and --dump take to be shown */
+		memcpy(fb->vmem, (uint8_t *)fb->vmem + fb->size, fb->size);
+		fb->page = 0;
+		fb->vinfo.yoffset = 0;
+		fb->backend->pan(fb);
+	}
+	if (fb->present != FB_PRESENT_DIRECT) {
+		free(fb->mem);
+	}
+	fb->mem = NULL;
+	if (fb->vmem != NULL && fb->vmem != MAP_FAILED) {
+		munmap(fb->vmem, fb->vsize);
+	}
+	fb->vmem = NULL;
+	if (fb->fd > 0) {
+		close(fb->fd);
+	}
+	fb->fd = 0;
+	fb_pool_free(fb->pool);
+	fb->pool = NULL;
+	free(fb->rows);
+	fb->rows = NULL;
+	glyph_cache_free(fb->glyphs);
+	fb->glyphs = NULL;
+	font_free(fb->font);
+	fb->font = NULL;
+	text_rows_free(fb);
+}
+
+/*
+ * Points fb->mem at visible page of video memory or, in back buffer modes,
+ * at a copy of it in ordinary cached memory.
+ */
+static int fb_select_buffer(struct fb *fb) {
+	uint8_t *visible = (uint8_t *)fb->vmem + fb->page * fb->size;
+	if (fb->present == FB_PRESENT_DIRECT) {
+		fb->mem = visible;
+		return EXIT_SUCCESS;
+	}
+	fb->mem = malloc(fb->size);
+	if (fb->mem == NULL) {
+		perror("Could not allocate back buffer");
+		return EXIT_FAILURE;
+	}
+	memcpy(fb->mem, visible, fb->size);
+	return EXIT_SUCCESS;
+}
+
+static int fbdev_open(struct fb *fb, struct fb_fix_screeninfo *finfo);
+
+static int fbdev_pan(struct fb *fb) {
+	const uint64_t start = trace_now();
+	if (ioctl(fb->fd, FBIOPAN_DISPLAY, &fb->vinfo)) {
+		trace_error("pan", NULL, strerror(errno), start);
+		perror("Could not ioctl(FBIOPAN_DISPLAY)");
+		return EXIT_FAILURE;
+	}
+	trace_end("pan", NULL, start);
+	return EXIT_SUCCESS;
+}
+
+static void omapfb_update(const struct fb *fb, const struct fb_rect *area) {
+	struct omapfb_update_window update;
+	update.x = area->x;
+	update.y = area->y;
+	update.width = area->width;
+	update.height = area->height;
+	update.format = fb->update_format;
+	update.out_x = area->x;
+	update.out_y = area->y;
+	update.out_width = area->width;
+	update.out_height = area->height;
+	if (ioctl(fb->fd, OMAPFB_UPDATE_WINDOW, &update) < 0) {
+//		perror("Could not ioctl(OMAPFB_UPDATE_WINDOW)");
+	}
+}
+
+static int fbdev_wait_vsync(const struct fb *fb) {
+	uint32_t crtc = 0;
+	return ioctl(fb->fd, FBIO_WAITFORVSYNC, &crtc) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+ * Waits for vertical blank or, on manual update displays which have none,
+ * for the previous update to finish, so the next one doesn't overtake it.
+ */
+static int omapfb_wait_vsync(const struct fb *fb) {
+	return ioctl(fb->fd, OMAPFB_WAITFORVSYNC) == 0 ||
+		ioctl(fb->fd, OMAPFB_SYNC_GFX) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Plain fbdev device, display refreshes itself from video memory */
+static const struct fb_backend fbdev_backend = {
+	"fbdev", fbdev_open, fbdev_pan, NULL, fbdev_wait_vsync
+};
+
+/* omapfb device, possibly in manual update mode */
+static const struct fb_backend omapfb_backend = {
+	"omapfb", fbdev_open, fbdev_pan, omapfb_update, omapfb_wait_vsync
+};
+
+static int fbdev_open(struct fb *fb, struct fb_fix_screeninfo *finfo) {
+	uint64_t start = trace_now();
+	if ((fb->fd = open(fb->device, O_RDWR)) < 0) {
+		trace_error("open", fb->device, strerror(errno), start);
+		perror("Could not open device");
+		return EXIT_FAILURE;
+	}
+	trace_end("open", fb->device, start);
+	start = trace_now();
+	if (ioctl(fb->fd, FBIOGET_FSCREENINFO, finfo)) {
+		trace_error("ioctl", "FBIOGET_FSCREENINFO", strerror(errno), start);
+		perror("Could not ioctl(FBIOGET_FSCREENINFO)");
+		return EXIT_FAILURE;
+	}
+	if (ioctl(fb->fd, FBIOGET_VSCREENINFO, &fb->vinfo)){
+		trace_error("ioctl", "FBIOGET_VSCREENINFO", strerror(errno), start);
+		perror("Could not ioctl(FBIOGET_VSCREENINFO)");
+		return EXIT_FAILURE;
+	}
+	trace_end("ioctl", "FBIOGET_FSCREENINFO,FBIOGET_VSCREENINFO", start);
+	if (strncmp(finfo->id, "omapfb", 6) == 0) {
+		fb->backend = &omapfb_backend;
+	}
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Fake framebuffer in memory, described by device string
+ * fake:<width>x<height>x<bpp>[,stride=<bytes>][,pages=<n>][,bgr][,file=<path>]
+ * Channels are laid out like common hardware does, rgb 5:6:5 at 16 bpp,
+ * x:r:g:b 8 bits each at 24 and 32 bpp and 8 bpp as pseudocolor; bgr swaps
+ * red and blue. Pixels live in given file, which is created as needed and keeps the
+ * last frame, or else in anonymous memory.
+ */
+static int fake_open(struct fb *fb, struct fb_fix_screeninfo *finfo) {
+	struct fb_var_screeninfo *vinfo = &fb->vinfo;
+	const char *spec = fb->device + strlen("fake:");
+	unsigned int width;
+	unsigned int height;
+	unsigned int bpp;
+	int used;
+	if (sscanf(spec, "%ux%ux%u%n", &width, &height, &bpp, &used) != 3 ||
+			width == 0 || height == 0) {
+		fputs("Invalid fake device, expected fake:<width>x<height>x<bpp>\n", stderr);
+		return EXIT_FAILURE;
+	}
+	unsigned int stride = width * ((bpp + 7) / 8);
+	unsigned int pages = 1;
+	bool bgr = false;
+	const char *file = NULL;
+	for (spec += used; *spec == ','; spec += strcspn(spec, ",")) {
+		++spec;
+		if (strncmp(spec, "file=", 5) == 0) {
+			file = spec + 5;
+			/* file name takes rest of the string */
+			break;
+		} else if (strcspn(spec, ",") == 3 && strncmp(spec, "bgr", 3) == 0) {
+			bgr = true;
+		} else if (sscanf(spec, "stride=%u", &stride) != 1 &&
+				sscanf(spec, "pages=%u", &pages) != 1) {
+			fprintf(stderr, "Invalid fake device parameter %s\n", spec);
+			return EXIT_FAILURE;
+		}
+	}
+	if (pages == 0 || stride < width * ((bpp + 7) / 8)) {
+		fputs("Invalid fake device geometry\n", stderr);
+		return EXIT_FAILURE;
+	}
+	memset(finfo, 0, sizeof(*finfo));
+	strcpy(finfo->id, "fake");
+	finfo->line_length = stride;
+	finfo->smem_len = stride * height * pages;
+	memset(vinfo, 0, sizeof(*vinfo));
+	vinfo->xres = vinfo->xres_virtual = width;
+	vinfo->yres = height;
+	vinfo->yres_virtual = height * pages;
+	vinfo->bits_per_pixel = bpp;
+	if (bpp == 16) {
+		vinfo->red.offset = 11;
+		vinfo->red.length = 5;
+		vinfo->green.offset = 5;
+		vinfo->green.length = 6;
+		vinfo->blue.length = 5;
+	} else if (bpp > 16) {
+		vinfo->red.offset = 16;
+		vinfo->red.length = 8;
+		vinfo->green.offset = 8;
+		vinfo->green.length = 8;
+		vinfo->blue.length = 8;
+	}
+	if (bgr) {
+		vinfo->blue.offset = vinfo->red.offset;
+		vinfo->red.offset = 0;
+	}
+	if (file != NULL) {
+		fb->fd = open(file, O_RDWR | O_CREAT, 0644);
+	} else {
+#ifdef MFD_CLOEXEC
+		fb->fd = memfd_create("text2screen", MFD_CLOEXEC);
+#else
+		/* mapped anonymously */
+		fb->fd = -1;
+		return EXIT_SUCCESS;
+#endif
+	}
+	if (fb->fd < 0) {
+		perror("Could not open fake device");
+		return EXIT_FAILURE;
+	}
+	struct stat st;
+	if (fstat(fb->fd, &st) != 0 || (st.st_size < (off_t)finfo->smem_len &&
+			ftruncate(fb->fd, finfo->smem_len) != 0)) {
+		perror("Could not size fake device");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+static int fake_pan(struct fb *fb) {
+	(void)fb;
+	return EXIT_SUCCESS;
+}
+
+static const struct fb_backend fake_backend = {
+	"fake", fake_open, fake_pan, NULL, NULL
+};
+
+/* Opens fb->device and maps it for drawing in fb->present mode */
+static int fb_init(struct fb *fb) {
+	struct fb_fix_screeninfo finfo;
+	fb->backend = strncmp(fb->device, "fake:", 5) == 0 ? &fake_backend : &fbdev_backend;
+	if (fb->backend->open(fb, &finfo) != EXIT_SUCCESS) {
+		fb_destroy(fb);
+		return EXIT_FAILURE;
+	}
+	const struct fb_var_screeninfo *vinfo = &fb->vinfo;
+	fb->size = finfo.line_length * vinfo->yres;
+	fb->width = vinfo->xres;
+	fb->height = vinfo->yres;
+	fb->line_len = finfo.line_length;
+	switch (vinfo->bits_per_pixel) {
+	case 8:
+		fb->update_format = OMAPFB_COLOR_CLUT_8BPP;
+		break;
+	case 16:
+		fb->update_format = OMAPFB_COLOR_RGB565;
+		break;
+	case 24:
+		fb->update_format = OMAPFB_COLOR_RGB24P;
+		break;
+	case 32:
+		fb->update_format = vinfo->transp.length ? OMAPFB_COLOR_ARGB32 : OMAPFB_COLOR_RGB24U;
+		break;
+	default:
+		/* rejected by fb_select_kernels() */
+		break;
+	}
+	fb_pool_start(fb);
+	if (fb_select_kernels(fb) != EXIT_SUCCESS) {
+		fb_destroy(fb);
+		return EXIT_FAILURE;
+	}
+	if (fb->present == FB_PRESENT_FLIP && (vinfo->yres_virtual < 2 * vinfo->yres ||
+			finfo.smem_len < 2 * fb->size)) {
+		/* no room for a second page */
+		fb->present = FB_PRESENT_COPY;
+	}
+	if ((fb->present == FB_PRESENT_FLIP || fb->keep_view) && vinfo->xoffset == 0 &&
+			vinfo->yoffset == vinfo->yres && finfo.smem_len >= 2 * fb->size) {
+		/* second page is already shown, keep it */
+		fb->page = 1;
+	} else if (vinfo->xoffset != 0 || vinfo->yoffset != 0) {
+		/* move viewport to upper left corner */
+		fb->vinfo.xoffset = 0;
+		fb->vinfo.yoffset = 0;
+		if (fb->backend->pan(fb) != EXIT_SUCCESS) {
+			fb_destroy(fb);
+			return EXIT_FAILURE;
+		}
+	}
+	/* back buffers and rotated buffers are seeded from the screen, so they need to read it */
+	const int prot = fb->present == FB_PRESENT_DIRECT && fb->rotate == 0 ?
+		PROT_WRITE : PROT_READ | PROT_WRITE;
+	fb->vsize = fb->present == FB_PRESENT_FLIP || fb->page == 1 ? 2 * fb->size : fb->size;
+	const uint64_t start = trace_now();
+	fb->vmem = fb->fd >= 0 ? mmap(0, fb->vsize, prot, MAP_SHARED, fb->fd, 0) :
+		mmap(0, fb->vsize, prot, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (fb->vmem == MAP_FAILED) {
+		trace_error("mmap", NULL, strerror(errno), start);
+		perror("Could not mmap device");
+		fb_destroy(fb);
+		return EXIT_FAILURE;
+	}
+	trace_end("mmap", NULL, start);
+	if (fb_select_buffer(fb) != EXIT_SUCCESS ||
+			(fb->rotate != 0 && fb_rotate_init(fb) != EXIT_SUCCESS)) {
+		fb_destroy(fb);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Moves back buffer contents to the screen.
+ * Copy mode stores the rows spanned by damaged areas with one memcpy.
+ * Flip mode fills the hidden page with the whole frame and pans to it,
+ * so no partially drawn frame is ever shown.
+ */
+static void fb_present(struct fb *fb) {
+	int top = fb->height;
+	int bottom = 0;
+	switch (fb->present) {
+	case FB_PRESENT_DIRECT:
+		break;
+	case FB_PRESENT_COPY:
+		if (fb->damage_count < 0) {
+			top = 0;
+			bottom = fb->height;
+		}
+		for (int i = 0; i < fb->damage_count; i++) {
+			const struct fb_rect *area = &fb->damage[i];
+			top = area->y < top ? area->y : top;
+			bottom = area->y + area->height > bottom ? area->y + area->height : bottom;
+		}
+		if (top < bottom) {
+			const size_t offset = (size_t)fb->line_len * top;
+			memcpy((uint8_t *)fb->vmem + offset, (uint8_t *)fb->mem + offset,
+				(size_t)fb->line_len * (bottom - top));
+		}
+		break;
+	case FB_PRESENT_FLIP:
+		if (fb->damage_count == 0) {
+			break;
+		}
+		fb->page = !fb->page;
+		memcpy((uint8_t *)fb->vmem + fb->page * fb->size, fb->mem, fb->size);
+		fb->vinfo.yoffset = fb->page * fb->height;
+		fb->backend->pan(fb);
+		fb->damage_count = -1;
+		break;
+	default:
+		break;
+	}
+}
+
+/* Presents and updates areas damaged since previous flush */
+static void fb_flush(struct fb *fb) {
+	const uint64_t start = trace_now();
+	if (fb->mem && fb->screen.mem != NULL) {
+		/* present and update the screen buffer the damage was turned onto */
+		fb_rotate_damage(fb);
+		fb_swap_plane(fb, &fb->screen);
+	}
+	if (fb->mem) {
+		fb_present(fb);
+	}
+	if (fb->mem && fb->backend->update != NULL) {
+		if (fb->damage_count < 0) {
+			const struct fb_rect screen = {0, 0, fb->width, fb->height};
+			fb->backend->update(fb, &screen);
+		}
+		for (int i = 0; i < fb->damage_count; i++) {
+			fb->backend->update(fb, &fb->damage[i]);
+		}
+	}
+	if (fb->mem && fb->screen.mem != NULL) {
+		fb_swap_plane(fb, &fb->screen);
+	}
+	fb->damage_count = 0;
+	trace_end("flush", NULL, start);
+}
+
+/* Normalizes coordinates (fixes negative width/height) */
+static void normalize(int *x, int *y, int *width, int *height) {
+	if (*width < 0) {
+		*width = -*width;
+		*x -= *width;
+	}
+	if (*height < 0) {
+		*height = -*height;
+		*y -= *height;
+	}
+}
+
+/* Area filled with one color, drawn band by band */
+struct fill_job {
+	uint8_t *out; /* top left corner */
+	int y;
+	int width;
+	const struct fb_blend *color;
+};
+
+static void fill_band(struct fb *fb, void *arg, const int band, const int y0, const int y1) {
+	const struct fill_job *job = arg;
+	uint8_t *out = job->out + (size_t)(y0 - job->y) * fb->line_len;
+	if (job->color->alpha == 256) {
+		fb->fill(out, fb_scratch(fb, band), fb, job->color->pixel, job->width, y1 - y0);
+		return;
+	}
+	for (int y = y0; y < y1; y++, out += fb->line_len) {
+		fb->blend(fb, out, job->color, job->width);
+	}
+}
+
+static int fb_clear(struct fb *fb, const uint32_t color, int x, int y,
+		int width, int height) {
+	if (width == 0) {
+		width = fb->width - x;
+	}
+	if (height == 0) {
+		height = fb->height - y;
+	}
+	normalize(&x, &y, &width, &height);
+	if (x < 0 || x + width > fb->width || y < 0 || y + height > fb->height) {
+		fputs("Boundaries out of range\n", stderr);
+		return EXIT_FAILURE;
+	}
+	uint8_t *out = (uint8_t *)fb->mem + (ptrdiff_t)(fb->line_len * y + fb->depth * x);
+
+	struct fb_blend blend;
+	blend_prepare(fb, &blend, color);
+	struct fill_job job = {out, y, width, &blend};
+	fb_parallel(fb, y, height, (size_t)width * height * fb->depth, fill_band, &job);
+	fb_damage(fb, x, y, width, height);
+	return EXIT_SUCCESS;
+}
+
+/* Fills columns [from, to) of progress bar area with native pixels, split at filled px */
+static void progress_fill(struct fb *fb, const struct fb_rect *area, const int filled,
+		const uint32_t fg_pixel, const uint32_t bg_pixel, const int from, const int to) {
+	const int split = filled < from ? from : filled > to ? to : filled;
+	uint8_t *out = (uint8_t *)fb->mem + (ptrdiff_t)(fb->line_len * area->y +
+		fb->depth * (area->x + from));
+	if (split > from) {
+		fb->fill(out, fb_scratch(fb, 0), fb, fg_pixel, split - from, area->height);
+	}
+	if (to > split) {
+		fb->fill(out + fb->depth * (split - from), fb_scratch(fb, 0), fb,
+			bg_pixel, to - split, area->height);
+	}
+	fb_damage(fb, area->x + from, area->y, to - from, area->height);
+}
+
+/*
+ * Draws horizontal progress bar, filled with fg_color for percent of its
+ * width and bg_color for the rest, optionally with caption centered on it.
+ * When fb->progress says the same bar is already on screen, only columns
+ * between old and new fill level and those under caption are redrawn,
+ * so each step costs in proportion to the change.
+ */
+static int fb_progress(struct fb *fb, const int percent, int x, int y,
+		int width, int height, const uint32_t fg_color, const uint32_t bg_color,
+		const char *caption, const uint32_t caption_color, const int scale) {
+	if (percent < 0 || percent > 100) {
+		fputs("Invalid progress, expected 0-100\n", stderr);
+		return EXIT_FAILURE;
+	}
+	if (width == 0) {
+		width = fb->width - x;
+	}
+	if (height == 0) {
+		height = 16;
+	}
+	normalize(&x, &y, &width, &height);
+	if (x < 0 || x + width > fb->width || y < 0 || y + height > fb->height) {
+		fputs("Boundaries out of range\n", stderr);
+		return EXIT_FAILURE;
+	}
+	if (!color_opaque(fg_color) || !color_opaque(bg_color)) {
+		/* steps redraw only part of the bar, blending over the old one */
+		fputs("Progress bar colors must be opaque\n", stderr);
+		return EXIT_FAILURE;
+	}
+	const struct fb_rect area = {x, y, width, height};
+	const int filled = width * percent / 100;
+	const uint32_t fg_pixel = fb_pack(fb, fg_color);
+	const uint32_t bg_pixel = fb_pack(fb, bg_color);
+	struct fb_progress *last = &fb->progress;
+	if (last->filled < 0 || memcmp(&last->area, &area, sizeof(area)) != 0 ||
+			last->fg_color != fg_color || last->bg_color != bg_color) {
+		progress_fill(fb, &area, filled, fg_pixel, bg_pixel, 0, width);
+	} else if (last->filled != filled) {
+		progress_fill(fb, &area, filled, fg_pixel, bg_pixel,
+			last->filled < filled ? last->filled : filled,
+			last->filled > filled ? last->filled : filled);
+	}
+	if (caption != NULL && caption[0]) {
+		const int letter_width = fb_font(fb)->width * scale;
+		const int letter_height = fb_font(fb)->height * scale;
+		const int caption_width = utf8_length(caption) * letter_width;
+		if (scale < 1 || caption_width > width || letter_height > height) {
+			fputs("Caption doesn't fit progress bar\n", stderr);
+			return EXIT_FAILURE;
+		}
+		const int caption_x = (width - caption_width) / 2;
+		/* caption text may change, so its background is always redrawn */
+		progress_fill(fb, &area, filled, fg_pixel, bg_pixel,
+			caption_x, caption_x + caption_width);
+		if (fb_write_text(fb, caption, scale, false, 0, caption_color,
+				x + caption_x, y + (height - letter_height) / 2,
+				NULL, NULL) != EXIT_SUCCESS) {
+			return EXIT_FAILURE;
+		}
+	}
+	last->area = area;
+	last->fg_color = fg_color;
+	last->bg_color = bg_color;
+	last->filled = filled;
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Loads fb->progress from state file path, so separate invocations can
+ * update a bar incrementally. Missing or unreadable state means unknown.
+ * Once this process has drawn anything, fb->progress knows better than
+ * the file and is kept. Like text state, this only holds while all
+ * drawing in between is done with the same state file.
+ */
+static void progress_load(struct fb *fb, const char *path) {
+	struct fb_progress *last = &fb->progress;
+	if (fb->drawn) {
+		return;
+	}
+	FILE *f = fopen(path, "r");
+	last->filled = -1;
+	if (f == NULL) {
+		return;
+	}
+	if (fscanf(f, "%d %d %d %d %x %x %d", &last->area.x, &last->area.y,
+			&last->area.width, &last->area.height, &last->fg_color,
+			&last->bg_color, &last->filled) != 7) {
+		last->filled = -1;
+	}
+	fclose(f);
+}
+
+static void progress_save(const struct fb *fb, const char *path) {
+	const struct fb_progress *last = &fb->progress;
+	FILE *f = fopen(path, "w");
+	if (f == NULL) {
+		perror("Could not save progress state");
+		return;
+	}
+	fprintf(f, "%d %d %d %d %x %x %d\n", last->area.x, last->area.y,
+		last->area.width, last->area.height, last->fg_color,
+		last->bg_color, last->filled);
+	fclose(f);
+}
+
+/*
+ * Loads fb->text_rows from state file path, so separate invocations can
+ * skip unchanged text too. State saved on a screen of other size or with
+ * another font is ignored. Like progress state, it only holds while all
+ * drawing in between is done with the same state file.
+ */
+static void text_state_load(struct fb *fb, const char *path) {
+	text_rows_free(fb);
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		return;
+	}
+	int width;
+	int height;
+	char font[256];
+	if (fscanf(f, "%d %d %255s", &width, &height, font) != 3 || width != fb->width ||
+			height != fb->height ||
+			strcmp(font, fb->font != NULL ? fb->font->path : "-") != 0) {
+		fclose(f);
+		return;
+	}
+	struct text_row *row = NULL;
+	char kind;
+	while (fscanf(f, " %c", &kind) == 1) {
+		int y;
+		int letter_height;
+		int scale;
+		int x0;
+		int cell_width;
+		int col;
+		struct text_cell cell;
+		int bg_clear;
+		if (kind == 'r' && fscanf(f, "%d %d %d %d %d", &y, &letter_height, &scale,
+				&x0, &cell_width) == 5 && y >= 0 && letter_height > 0 &&
+				y + letter_height <= fb->height && scale > 0 && cell_width > 0 &&
+				x0 >= 0 && x0 < cell_width) {
+			row = text_row_get(fb, y, letter_height, scale, cell_width, x0);
+		} else if (kind == 'c' && row != NULL && fscanf(f, "%d %x %x %x %d", &col,
+				&cell.glyph, &cell.fg_color, &cell.bg_color, &bg_clear) == 5 &&
+				col >= 0 && col < row->cols) {
+			cell.bg_clear = bg_clear != 0;
+			row->cells[col] = cell;
+		} else {
+			text_rows_free(fb);
+			break;
+		}
+	}
+	fclose(f);
+}
+
+/* Saves known cells of fb->text_rows, one line per row and per cell */
+static void text_state_save(const struct fb *fb, const char *path) {
+	FILE *f = fopen(path, "w");
+	if (f == NULL) {
+		perror("Could not save text state");
+		return;
+	}
+	fprintf(f, "%d %d %s\n", fb->width, fb->height, fb->font != NULL ? fb->font->path : "-");
+	for (int i = 0; fb->text_rows != NULL && i < TEXT_ROWS_MAX; i++) {
+		const struct text_row *row = &fb->text_rows[i];
+		bool header = false;
+		for (int col = 0; col < row->cols; col++) {
+			const struct text_cell *cell = &row->cells[col];
+			if (cell->glyph == 0) {
+				continue;
+			}
+			if (!header) {
+				fprintf(f, "r %d %d %d %d %d\n", row->y, row->height, row->scale,
+					row->x0, row->cell_width);
+				header = true;
+			}
+			fprintf(f, "c %d %x %x %x %d\n", col, cell->glyph, cell->fg_color,
+				cell->bg_color, cell->bg_clear);
+		}
+	}
+	fclose(f);
+}
+
+/* Pixel layouts --image reads, raw ones little-endian */
+enum image_format {
+	IMAGE_RGB565,
+	IMAGE_XRGB8888,
+	IMAGE_RGB888 /* binary PPM */
+};
+
+/* Image file mapped read-only */
+struct image_file {
+	void *map;
+	size_t map_size;
+	enum image_format format;
+	int width;
+	int height;
+	size_t stride; /* bytes per image row */
+	const uint8_t *pixels;
+};
+
+static size_t image_pixel_size(const enum image_format format) {
+	return format == IMAGE_RGB565 ? 2 : format == IMAGE_XRGB8888 ? 4 : 3;
+}
+
+/* Skips whitespace and comments between PPM header fields */
+static const char *ppm_skip(const char *p, const char *end) {
+	while (p < end && (*p == '#' || strchr(" \t\r\n", *p) != NULL)) {
+		if (*p == '#') {
+			while (p < end && *p != '\n') {
+				++p;
+			}
+		} else {
+			++p;
+		}
+	}
+	return p;
+}
+
+/* Reads decimal PPM header field at *p */
+static bool ppm_field(const char **p, const char *end, unsigned int *value) {
+	*p = ppm_skip(*p, end);
+	if (*p == end || **p < '0' || **p > '9') {
+		return false;
+	}
+	*value = 0;
+	while (*p < end && **p >= '0' && **p <= '9' && *value < 100000) {
+		*value = *value * 10 + (*(*p)++ - '0');
+	}
+	return true;
+}
+
+static void image_free(struct image_file *img) {
+	if (img->map != NULL && img->map != MAP_FAILED) {
+		munmap(img->map, img->map_size);
+	}
+	img->map = NULL;
+}
+
+/*
+ * Maps image file at path. It is binary PPM with 8-bit channels unless raw
+ * is given, as <width>x<height>x<bpp>[,stride=<bytes>] of RGB565 (16 bpp)
+ * or XRGB8888 (32 bpp) pixels.
+ */
+static int image_load(struct image_file *img, const char *path, const char *raw) {
+	memset(img, 0, sizeof(*img));
+	unsigned int width = 0;
+	unsigned int height = 0;
+	unsigned int bpp = 0;
+	unsigned int stride = 0;
+	int used = 0;
+	if (raw != NULL && (sscanf(raw, "%ux%ux%u%n", &width, &height, &bpp, &used) != 3 ||
+			(bpp != 16 && bpp != 32) ||
+			(raw[used] != '\0' && sscanf(raw + used, ",stride=%u", &stride) != 1))) {
+		fputs("Invalid raw image geometry, expected <width>x<height>x{16|32}\n", stderr);
+		return EXIT_FAILURE;
+	}
+	const int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		perror("Could not open image");
+		if (fd >= 0) {
+			close(fd);
+		}
+		return EXIT_FAILURE;
+	}
+	img->map_size = st.st_size;
+	img->map = img->map_size ? mmap(0, img->map_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+	close(fd);
+	if (img->map == MAP_FAILED) {
+		perror("Could not mmap image");
+		return EXIT_FAILURE;
+	}
+	const char *data = img->map;
+	const char *end = data + img->map_size;
+	if (raw != NULL) {
+		img->format = bpp == 16 ? IMAGE_RGB565 : IMAGE_XRGB8888;
+		img->pixels = img->map;
+	} else {
+		unsigned int maxval = 0;
+		const char *p = data + 2;
+		if (img->map_size < 2 || strncmp(data, "P6", 2) != 0 ||
+				!ppm_field(&p, end, &width) || !ppm_field(&p, end, &height) ||
+				!ppm_field(&p, end, &maxval) || maxval != 255 || p == end) {
+			fputs("Unsupported image, expected binary PPM with 8-bit channels\n", stderr);
+			image_free(img);
+			return EXIT_FAILURE;
+		}
+		img->format = IMAGE_RGB888;
+		/* single whitespace character ends header */
+		img->pixels = (const uint8_t *)p + 1;
+	}
+	const size_t row_size = (size_t)width * image_pixel_size(img->format);
+	const size_t available = (const char *)img->pixels < end ?
+		(size_t)(end - (const char *)img->pixels) : 0;
+	img->width = width;
+	img->height = height;
+	img->stride = stride ? stride : row_size;
+	if (width == 0 || height == 0 || width > INT16_MAX || height > INT16_MAX ||
+			img->stride < row_size || available < row_size ||
+			(available - row_size) / img->stride < height - 1) {
+		fputs("Invalid or truncated image\n", stderr);
+		image_free(img);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/* Tells whether image rows can be copied to fb as they are */
+static bool image_is_native(const struct fb *fb, const struct image_file *img) {
+	static const struct fb_channel rgb565[3] = {{11, 5}, {5, 6}, {0, 5}};
+	static const struct fb_channel xrgb8888[3] = {{16, 8}, {8, 8}, {0, 8}};
+	const struct fb_format *format = &fb->format;
+	switch (img->format) {
+	case IMAGE_RGB565:
+		return fb->depth == 2 && memcmp(format->channels, rgb565, sizeof(rgb565)) == 0;
+	case IMAGE_XRGB8888:
+		return fb->depth == 4 && format->opaque == 0 &&
+			memcmp(format->channels, xrgb8888, sizeof(xrgb8888)) == 0;
+	case IMAGE_RGB888:
+	default:
+		return false;
+	}
+}
+
+/* Expands n image pixels to 24-bit rgb, PPM data being byte aligned only */
+static void image_row_to_888(const enum image_format format, const uint8_t *in,
+		uint32_t *out, const size_t n) {
+	size_t i = 0;
+	switch (format) {
+	case IMAGE_RGB565:
+		for (; i + 4 <= n; i += 4) {
+			u16x4 pixels;
+			memcpy(&pixels, in + 2 * i, sizeof(pixels));
+			const u32x4 c = u16x4_to_u32x4(pixels);
+			const u32x4 rgb = (c & 0xf800) << 8 | (c & 0x07e0) << 5 | (c & 0x001f) << 3;
+			memcpy(out + i, &rgb, sizeof(rgb));
+		}
+		for (; i < n; i++) {
+			const uint32_t c = in[2 * i] | (uint32_t)in[2 * i + 1] << 8;
+			out[i] = (c & 0xf800) << 8 | (c & 0x07e0) << 5 | (c & 0x001f) << 3;
+		}
+		break;
+	case IMAGE_XRGB8888:
+		for (; i + 4 <= n; i += 4) {
+			u32x4 rgb;
+			memcpy(&rgb, in + 4 * i, sizeof(rgb));
+			rgb &= 0xffffff;
+			memcpy(out + i, &rgb, sizeof(rgb));
+		}
+		for (; i < n; i++) {
+			out[i] = in[4 * i] | (uint32_t)in[4 * i + 1] << 8 | (uint32_t)in[4 * i + 2] << 16;
+		}
+		break;
+	case IMAGE_RGB888:
+	default:
+		for (; i < n; i++) {
+			out[i] = (uint32_t)in[3 * i] << 16 | (uint32_t)in[3 * i + 1] << 8 | in[3 * i + 2];
+		}
+		break;
+	}
+}
+
+/* Shifts packing 24-bit rgb into fb's format, as fb_pack() does */
+struct pack_shifts {
+	uint32_t down[3]; /* to channel length */
+	uint32_t up[3]; /* to channel place */
+	uint32_t opaque;
+};
+
+static inline uint32_t pack_pixel(const uint32_t rgb, const struct pack_shifts *s) {
+	return s->opaque |
+		(rgb >> 16 & 0xff) >> s->down[0] << s->up[0] |
+		(rgb >> 8 & 0xff) >> s->down[1] << s->up[1] |
+		(rgb & 0xff) >> s->down[2] << s->up[2];
+}
+
+static inline u32x4 pack_pixels(const uint32_t *in, const struct pack_shifts *s) {
+	u32x4 rgb;
+	memcpy(&rgb, in, sizeof(rgb));
+	return s->opaque |
+		(rgb >> 16 & 0xff) >> s->down[0] << s->up[0] |
+		(rgb >> 8 & 0xff) >> s->down[1] << s->up[1] |
+		(rgb & 0xff) >> s->down[2] << s->up[2];
+}
+
+/* Packs n 24-bit rgb pixels into fb's native format */
+static void pack_row(const struct fb *fb, const uint32_t *in, uint8_t *out, const size_t n) {
+	struct pack_shifts s;
+	for (int c = 0; c < 3; c++) {
+		const struct fb_channel *channel = &fb->format.channels[c];
+		s.down[c] = channel->length >= 8 ? 0 : 8 - channel->length;
+		s.up[c] = (channel->length >= 8 ? channel->length - 8 : 0) + channel->offset;
+	}
+	s.opaque = fb->format.opaque;
+	size_t i = 0;
+	switch (fb->depth) {
+	case 1:
+		for (; i + 4 <= n; i += 4) {
+			const u8x4 pixels = u32x4_to_u8x4(pack_pixels(in + i, &s));
+			memcpy(out + i, &pixels, sizeof(pixels));
+		}
+		for (; i < n; i++) {
+			out[i] = pack_pixel(in[i], &s);
+		}
+		break;
+	case 2:
+		for (; i + 4 <= n; i += 4) {
+			const u16x4 pixels = u32x4_to_u16x4(pack_pixels(in + i, &s));
+			memcpy(out + 2 * i, &pixels, sizeof(pixels));
+		}
+		for (; i < n; i++) {
+			((uint16_t *)(void *)out)[i] = pack_pixel(in[i], &s);
+		}
+		break;
+	case 3:
+		for (; i < n; i++) {
+			const uint32_t pixel = pack_pixel(in[i], &s);
+			out[3 * i] = pixel;
+			out[3 * i + 1] = pixel >> 8;
+			out[3 * i + 2] = pixel >> 16;
+		}
+		break;
+	default:
+		for (; i + 4 <= n; i += 4) {
+			const u32x4 pixels = pack_pixels(in + i, &s);
+			memcpy(out + 4 * i, &pixels, sizeof(pixels));
+		}
+		for (; i < n; i++) {
+			((uint32_t *)(void *)out)[i] = pack_pixel(in[i], &s);
+		}
+		break;
+	}
+}
+
+/* Pixels converted at once, through a buffer that stays in L1 cache */
+#define IMAGE_CHUNK 256
+
+/* Clipped part of image placed on screen, drawn band by band */
+struct image_job {
+	const struct image_file *img;
+	const uint8_t *in; /* top left corner of visible part */
+	uint8_t *out; /* its place on screen */
+	int y;
+	int width;
+	bool native;
+};
+
+static void image_band(struct fb *fb, void *arg, const int band, const int y0, const int y1) {
+	const struct image_job *job = arg;
+	const size_t in_pixel = image_pixel_size(job->img->format);
+	const uint8_t *in = job->in + (size_t)(y0 - job->y) * job->img->stride;
+	uint8_t *out = job->out + (size_t)(y0 - job->y) * fb->line_len;
+	const size_t row_size = (size_t)job->width * fb->depth;
+	(void)band;
+	if (job->native && row_size == fb->line_len && job->img->stride == fb->line_len) {
+		memcpy(out, in, row_size * (y1 - y0));
+		return;
+	}
+	uint32_t rgb[IMAGE_CHUNK];
+	for (int y = y0; y < y1; y++) {
+		if (job->native) {
+			memcpy(out, in, row_size);
+		} else {
+			for (int x = 0; x < job->width; x += IMAGE_CHUNK) {
+				const size_t n = job->width - x < IMAGE_CHUNK ? job->width - x : IMAGE_CHUNK;
+				image_row_to_888(job->img->format, in + x * in_pixel, rgb, n);
+				pack_row(fb, rgb, out + (size_t)x * fb->depth, n);
+			}
+		}
+		in += job->img->stride;
+		out += fb->line_len;
+	}
+}
+
+/*
+ * Draws image file at x, y or aligned, cut to the screen. Rows matching
+ * fb's format are copied, others are converted a chunk at a time.
+ */
+static int fb_image(struct fb *fb, const char *path, const char *raw, int x, int y,
+		const char *halign, const char *valign) {
+	if (x != 0 && halign != NULL) {
+		fputs("You can't specify -H and -x at the same time\n", stderr);
+		return EXIT_FAILURE;
+	} else if (y != 0 && valign != NULL) {
+		fputs("You can't specify -V and -y at the same time\n", stderr);
+		return EXIT_FAILURE;
+	}
+	struct image_file img;
+	if (image_load(&img, path, raw) != EXIT_SUCCESS) {
+		return EXIT_FAILURE;
+	}
+	int ret = EXIT_SUCCESS;
+	if (halign == NULL || strcmp(halign, "left") == 0) {
+		/* noop */
+	} else if (strcmp(halign, "right") == 0) {
+		x = fb->width - img.width;
+	} else if (strcmp(halign, "center") == 0) {
+		x = (fb->width - img.width) / 2;
+	} else {
+		fputs("Invalid horizontal alignment\n", stderr);
+		ret = EXIT_FAILURE;
+	}
+	if (valign == NULL || strcmp(valign, "top") == 0) {
+		/* noop */
+	} else if (strcmp(valign, "center") == 0) {
+		y = (fb->height - img.height) / 2;
+	} else if (strcmp(valign, "bottom") == 0) {
+		y = fb->height - img.height;
+	} else {
+		fputs("Invalid vertical alignment\n", stderr);
+		ret = EXIT_FAILURE;
+	}
+	/* part of image on screen */
+	const int left = x < 0 ? -x : 0;
+	const int top = y < 0 ? -y : 0;
+	const int right = x + img.width > fb->width ? fb->width - x : img.width;
+	const int bottom = y + img.height > fb->height ? fb->height - y : img.height;
+	if (ret == EXIT_SUCCESS && (left >= right || top >= bottom)) {
+		fputs("Out of screen bounds\n", stderr);
+		ret = EXIT_FAILURE;
+	}
+	if (ret == EXIT_SUCCESS) {
+		const size_t in_pixel = image_pixel_size(img.format);
+		struct image_job job = {
+			&img,
+			img.pixels + top * img.stride + left * in_pixel,
+			(uint8_t *)fb->mem + (size_t)(y + top) * fb->line_len +
+				(size_t)(x + left) * fb->depth,
+			y + top,
+			right - left,
+			image_is_native(fb, &img)
+		};
+		fb_parallel(fb, y + top, bottom - top,
+			(size_t)(right - left) * (bottom - top) * fb->depth, image_band, &job);
+		fb_damage(fb, x + left, y + top, right - left, bottom - top);
+	}
+	image_free(&img);
+	return ret;
+}
+
+/* Output gathered before each write, whatever the dumped area's size */
+#define DUMP_BUFFER (64 * 1024)
+
+/* Loads 4 native pixels of depth bytes each */
+static inline u32x4 load_pixels(const uint8_t *in, const uint32_t depth) {
+	u32x4 pixels;
+	switch (depth) {
+	case 1: {
+		u8x4 bytes;
+		memcpy(&bytes, in, sizeof(bytes));
+		pixels = u8x4_to_u32x4(bytes);
+		break;
+	}
+	case 2: {
+		u16x4 halves;
+		memcpy(&halves, in, sizeof(halves));
+		pixels = u16x4_to_u32x4(halves);
+		break;
+	}
+	case 3:
+		for (int k = 0; k < 4; k++) {
+			pixels[k] = in[3 * k] | in[3 * k + 1] << 8 | (uint32_t)in[3 * k + 2] << 16;
+		}
+		break;
+	default:
+		memcpy(&pixels, in, sizeof(pixels));
+		break;
+	}
+	return pixels;
+}
+
+/* Unpacks n native pixels into 8-bit r, g, b byte triples */
+static void unpack_row(const struct fb *fb, const uint8_t *in, uint8_t *out, const size_t n) {
+	uint32_t offset[3];
+	uint32_t mask[3];
+	uint32_t down[3];
+	uint32_t up[3];
+	for (int c = 0; c < 3; c++) {
+		const struct fb_channel *channel = &fb->format.channels[c];
+		offset[c] = channel->offset;
+		mask[c] = (1U << channel->length) - 1;
+		down[c] = channel->length > 8 ? channel->length - 8 : 0;
+		up[c] = channel->length < 8 ? 8 - channel->length : 0;
+	}
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		const u32x4 pixels = load_pixels(in + i * fb->depth, fb->depth);
+		const u32x4 r = (pixels >> offset[0] & mask[0]) >> down[0] << up[0];
+		const u32x4 g = (pixels >> offset[1] & mask[1]) >> down[1] << up[1];
+		const u32x4 b = (pixels >> offset[2] & mask[2]) >> down[2] << up[2];
+		for (int k = 0; k < 4; k++) {
+			out[3 * (i + k)] = r[k];
+			out[3 * (i + k) + 1] = g[k];
+			out[3 * (i + k) + 2] = b[k];
+		}
+	}
+	for (; i < n; i++) {
+		const uint8_t *p = in + i * fb->depth;
+		uint32_t pixel = 0;
+		for (uint32_t k = 0; k < fb->depth; k++) {
+			pixel |= (uint32_t)p[k] << (8 * k);
+		}
+		for (int c = 0; c < 3; c++) {
+			out[3 * i + c] = (pixel >> offset[c] & mask[c]) >> down[c] << up[c];
+		}
+	}
+}
+
+static bool write_all(const int fd, const uint8_t *buf, size_t len) {
+	while (len > 0) {
+		const ssize_t written = write(fd, buf, len);
+		if (written <= 0) {
+			return false;
+		}
+		buf += written;
+		len -= written;
+	}
+	return true;
+}
+
+/*
+ * Writes what screen shows, or its area, to path or stdout for "-" as
+ * binary PPM or, with raw, native pixels in packed rows. Pending drawing
+ * is flushed first. Video memory is read through its own read-only
+ * mapping, in chunks converted into a bounded buffer.
+ */
+static int fb_dump(struct fb *fb, const char *path, const bool raw, int x, int y,
+		int width, int height) {
+	if (width == 0) {
+		width = fb->width - x;
+	}
+	if (height == 0) {
+		height = fb->height - y;
+	}
+	normalize(&x, &y, &width, &height);
+	if (x < 0 || x + width > fb->width || y < 0 || y + height > fb->height) {
+		fputs("Boundaries out of range\n", stderr);
+		return EXIT_FAILURE;
+	}
+	fb_flush(fb);
+	const size_t page_offset = (size_t)fb->page * fb->size;
+	void *map = NULL;
+	const uint8_t *screen = (const uint8_t *)fb->vmem + page_offset;
+	if (fb->screen.mem != NULL) {
+		/* the upright buffer holds the screen as drawn, in dump coordinates */
+		screen = fb->mem;
+	} else if (fb->fd >= 0) {
+		map = mmap(0, page_offset + fb->size, PROT_READ, MAP_SHARED, fb->fd, 0);
+		if (map == MAP_FAILED) {
+			perror("Could not mmap device for reading");
+			return EXIT_FAILURE;
+		}
+		madvise(map, page_offset + fb->size, MADV_SEQUENTIAL);
+		screen = (const uint8_t *)map + page_offset;
+	}
+	const int fd = strcmp(path, "-") == 0 ? STDOUT_FILENO :
+		open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	uint8_t *buf = malloc(DUMP_BUFFER);
+	bool ok = fd >= 0 && buf != NULL;
+	size_t used = 0;
+	if (ok && !raw) {
+		used = snprintf((char *)buf, DUMP_BUFFER, "P6\n%d %d\n255\n", width, height);
+	}
+	/* pixels taken per step, so one step always fits the buffer */
+	const size_t out_pixel = raw ? fb->depth : 3;
+	const size_t chunk = DUMP_BUFFER / 2 / out_pixel;
+	for (int j = 0; ok && j < height; j++) {
+		const uint8_t *in = screen + (size_t)(y + j) * fb->line_len + (size_t)x * fb->depth;
+		for (size_t i = 0; ok && i < (size_t)width; i += chunk) {
+			const size_t n = width - i < chunk ? width - i : chunk;
+			if (raw) {
+				memcpy(buf + used, in + i * fb->depth, n * fb->depth);
+			} else {
+				unpack_row(fb, in + i * fb->depth, buf + used, n);
+			}
+			used += n * out_pixel;
+			if (used > DUMP_BUFFER / 2) {
+				ok = write_all(fd, buf, used);
+				used = 0;
+			}
+		}
+	}
+	if (ok && used > 0) {
+		ok = write_all(fd, buf, used);
+	}
+	if (!ok) {
+		perror(buf == NULL ? "Could not allocate dump buffer" : "Could not write dump");
+	}
+	free(buf);
+	if (fd >= 0 && fd != STDOUT_FILENO) {
+		close(fd);
+	}
+	if (map != NULL) {
+		munmap(map, page_offset + fb->size);
+	}
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Bytes read from console input at a time */
+#define CONSOLE_BUFFER 4096
+/* Longest time console input is taken in without showing it, in ms */
+#define CONSOLE_FRAME 20
+#define CONSOLE_TAB 8
+
+enum console_escape {
+	CONSOLE_TEXT,
+	CONSOLE_ESCAPE, /* after ESC */
+	CONSOLE_CSI /* in ESC [ sequence, up to its final byte */
+};
+
+/*
+ * Text console tailing a stream onto rows [y, y + height) of the screen.
+ * Characters are laid out into pending glyphs as they are read and drawn
+ * once per frame, after scrolling the area by all rows added meanwhile.
+ */
+struct fb_console {
+	const struct fb_font *font;
+	struct glyph_cache *cache;
+	uint32_t bg_color;
+	int y;
+	int height;
+	int letter_width;
+	int letter_height;
+	int columns;
+	int rows;
+	bool pan; /* scroll by panning through yres_virtual, else by memmove */
+	/* cursor, row past the last one while scrolling is pending */
+	int column;
+	int row;
+	enum console_escape escape;
+	/* glyphs read since last frame, y being their row until drawn */
+	struct text_glyph *glyphs;
+	size_t count;
+	size_t capacity;
+	struct timespec drawn; /* time of last frame */
+};
+
+/* Milliseconds from start to now */
+static long elapsed_ms(const struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/*
+ * Maps video memory readable, for scrolling by memmove, or in direct mode
+ * with the area covering the whole screen, all of yres_virtual, for
+ * scrolling by panning. Panning needs room for at least one more row.
+ */
+static void console_map(struct fb *fb, struct fb_console *con) {
+	if (fb->present != FB_PRESENT_DIRECT || fb->rotate != 0) {
+		/* back buffer and upright buffer are ordinary memory */
+		return;
+	}
+	const size_t vsize = (size_t)fb->vinfo.yres_virtual * fb->line_len;
+	if (fb->fd >= 0 && con->y == 0 && con->height == fb->height &&
+			fb->vinfo.yres_virtual >= fb->vinfo.yres + con->letter_height) {
+		void *vmem = mmap(0, vsize, PROT_READ | PROT_WRITE, MAP_SHARED, fb->fd, 0);
+		if (vmem != MAP_FAILED) {
+			munmap(fb->vmem, fb->vsize);
+			fb->mem = fb->vmem = vmem;
+			fb->vsize = vsize;
+			con->pan = true;
+			return;
+		}
+	}
+	if (mprotect(fb->vmem, fb->vsize, PROT_READ | PROT_WRITE) != 0) {
+		perror("Could not make video memory readable");
+	}
+}
+
+/*
+ * Scrolls console area up by distance px. Panning moves fb->mem down over
+ * video memory, wrapping to its start with one memmove of the rows kept
+ * once the end is reached; the new position is shown by console_pan().
+ */
+static void console_scroll(struct fb *fb, const struct fb_console *con, const int distance) {
+	const size_t kept = (size_t)(con->height - distance) * fb->line_len;
+	uint8_t *area = (uint8_t *)fb->mem + (size_t)con->y * fb->line_len;
+	if (!con->pan) {
+		memmove(area, area + (size_t)distance * fb->line_len, kept);
+		return;
+	}
+	const uint32_t yoffset = fb->vinfo.yoffset + distance;
+	if (yoffset + fb->vinfo.yres <= fb->vinfo.yres_virtual) {
+		fb->mem = area + (size_t)distance * fb->line_len;
+	} else {
+		memmove(fb->vmem, area + (size_t)distance * fb->line_len, kept);
+		fb->mem = fb->vmem;
+	}
+}
+
+/* Shows fb->mem after console_scroll() panned */
+static void console_pan(struct fb *fb) {
+	const uint32_t yoffset = ((uint8_t *)fb->mem - (uint8_t *)fb->vmem) / fb->line_len;
+	if (yoffset != fb->vinfo.yoffset) {
+		fb->vinfo.yoffset = yoffset;
+		fb->backend->pan(fb);
+	}
+}
+
+/*
+ * Draws pending glyphs as one frame: scrolls by the rows the cursor moved
+ * past the area, clears rows that came in and draws glyphs still on screen.
+ */
+static void console_draw(struct fb *fb, struct fb_console *con) {
+	const uint64_t start = trace_now();
+	const int scroll = con->row >= con->rows ? con->row - con->rows + 1 : 0;
+	const int bottom = con->y + con->height;
+	if (scroll >= con->rows) {
+		fb_clear(fb, con->bg_color, 0, con->y, fb->width, con->height);
+	} else if (scroll > 0) {
+		const int distance = scroll * con->letter_height;
+		console_scroll(fb, con, distance);
+		fb_clear(fb, con->bg_color, 0, bottom - distance, fb->width, distance);
+		fb_damage(fb, 0, con->y, fb->width, con->height);
+	}
+	int top = bottom;
+	int low = con->y;
+	size_t count = 0;
+	for (size_t i = 0; i < con->count; i++) {
+		struct text_glyph glyph = con->glyphs[i];
+		if (glyph.y < scroll) {
+			continue;
+		}
+		glyph.y = con->y + (glyph.y - scroll) * con->letter_height;
+		top = glyph.y < top ? glyph.y : top;
+		low = glyph.y + con->letter_height > low ? glyph.y + con->letter_height : low;
+		con->glyphs[count++] = glyph;
+	}
+	if (count > 0) {
+		struct text_job job = {con->cache, con->glyphs, count, con->letter_height, true};
+		fb_parallel(fb, top, low - top,
+			count * con->letter_width * con->letter_height * fb->depth, text_band, &job);
+		fb_damage(fb, 0, top, fb->width, low - top);
+	}
+	con->count = 0;
+	con->row -= scroll;
+	trace_end("render", "console", start);
+	if (con->pan) {
+		console_pan(fb);
+	}
+	fb_flush(fb);
+	clock_gettime(CLOCK_MONOTONIC, &con->drawn);
+}
+
+/* Drops pending glyphs that scrolled off before being drawn */
+static void console_compact(struct fb_console *con) {
+	const int first = con->row - con->rows + 1;
+	size_t count = 0;
+	for (size_t i = 0; i < con->count; i++) {
+		if (con->glyphs[i].y >= first) {
+			con->glyphs[count++] = con->glyphs[i];
+		}
+	}
+	con->count = count;
+}
+
+/* Moves cursor to start of next row */
+static void console_newline(struct fb_console *con) {
+	con->column = 0;
+	++con->row;
+}
+
+/* Lays out UTF-8 text[0, len) at cursor, text[len] being '\0' */
+static int console_write(struct fb_console *con, const char *text, const size_t len) {
+	const char *end = text + len;
+	while (text < end) {
+		const uint32_t code = utf8_next(&text);
+		if (con->escape == CONSOLE_ESCAPE) {
+			con->escape = code == '[' ? CONSOLE_CSI : CONSOLE_TEXT;
+			continue;
+		} else if (con->escape == CONSOLE_CSI) {
+			if (code >= 0x40 && code <= 0x7e) {
+				con->escape = CONSOLE_TEXT;
+			}
+			continue;
+		}
+		switch (code) {
+		case '\n':
+			console_newline(con);
+			continue;
+		case '\r':
+			con->column = 0;
+			continue;
+		case '\t':
+			con->column = (con->column / CONSOLE_TAB + 1) * CONSOLE_TAB;
+			con->column = con->column < con->columns ? con->column : con->columns;
+			continue;
+		case '\b':
+			con->column -= con->column > 0 ? 1 : 0;
+			continue;
+		case 0x1b:
+			con->escape = CONSOLE_ESCAPE;
+			continue;
+		default:
+			if (code < 0x20 || code == 0x7f) {
+				continue;
+			}
+			break;
+		}
+		/* wrap only once there is a character for the next row */
+		if (con->column == con->columns) {
+			console_newline(con);
+		}
+		struct text_glyph *glyph = &con->glyphs[con->count++];
+		glyph->x = con->column * con->letter_width;
+		glyph->y = con->row;
+		glyph->slot = glyph_cache_slot(con->cache, con->font, font_glyph(con->font, code));
+		if (glyph->slot < 0) {
+			return EXIT_FAILURE;
+		}
+		++con->column;
+	}
+	return EXIT_SUCCESS;
+}
+
+/* Returns length of incomplete UTF-8 sequence ending text[0, len) */
+static size_t utf8_incomplete(const char *text, const size_t len) {
+	for (size_t i = 1; i <= 3 && i <= len; i++) {
+		const uint8_t c = text[len - i];
+		if ((c & 0xc0) == 0x80) {
+			continue;
+		}
+		const size_t need = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : c >= 0xc2 ? 2 : 1;
+		return need > i ? i : 0;
+	}
+	return 0;
+}
+
+/* Returns whether fd has input ready right now */
+static bool input_ready(const int fd) {
+	struct pollfd pfd = {fd, POLLIN, 0};
+	return poll(&pfd, 1, 0) > 0;
+}
+
+/*
+ * Tails fd onto rows [y, y + height) of the screen, a height of 0 meaning
+ * down to the bottom, until end of input. Text wraps at screen width, \n,
+ * \r, \t and \b move the cursor and escape sequences are skipped. When
+ * input comes faster than it can be shown, it is taken in for up to
+ * CONSOLE_FRAME ms before the next frame, which scrolls just once for
+ * all of it; rows scrolled off in between are never drawn.
+ */
+static int fb_console(struct fb *fb, const int fd, const int scale,
+		const uint32_t bg_color, const uint32_t fg_color, int y, int height) {
+	if (scale < 1) {
+		fputs("Invalid scale\n", stderr);
+		return EXIT_FAILURE;
+	}
+	if (height == 0) {
+		height = fb->height - y;
+	}
+	int x = 0;
+	int width = fb->width;
+	normalize(&x, &y, &width, &height);
+	struct fb_console con = {0};
+	con.font = fb_font(fb);
+	con.bg_color = bg_color;
+	con.y = y;
+	con.height = height;
+	con.letter_width = scale * con.font->width;
+	con.letter_height = scale * con.font->height;
+	con.columns = fb->width / con.letter_width;
+	con.rows = height / con.letter_height;
+	if (y < 0 || y + height > fb->height) {
+		fputs("Boundaries out of range\n", stderr);
+		return EXIT_FAILURE;
+	} else if (con.columns == 0 || con.rows == 0) {
+		fputs("Console area is too small\n", stderr);
+		return EXIT_FAILURE;
+	}
+	con.cache = glyph_cache_get(fb, scale, bg_color, fg_color);
+	if (con.cache == NULL) {
+		return EXIT_FAILURE;
+	}
+	/* a screenful of glyphs left after compacting and one more read */
+	con.capacity = (size_t)con.columns * con.rows + CONSOLE_BUFFER;
+	con.glyphs = malloc(con.capacity * sizeof(*con.glyphs));
+	char *buf = malloc(CONSOLE_BUFFER + 1);
+	if (con.glyphs == NULL || buf == NULL) {
+		perror("Could not allocate console");
+		free(con.glyphs);
+		free(buf);
+		return EXIT_FAILURE;
+	}
+	console_map(fb, &con);
+	fb_clear(fb, bg_color, 0, y, fb->width, height);
+	console_draw(fb, &con);
+	int ret = EXIT_SUCCESS;
+	size_t carry = 0;
+	for (;;) {
+		if (con.count + CONSOLE_BUFFER > con.capacity) {
+			console_compact(&con);
+			if (con.count + CONSOLE_BUFFER > con.capacity) {
+				console_draw(fb, &con);
+			}
+		}
+		const ssize_t got = read(fd, buf + carry, CONSOLE_BUFFER - carry);
+		if (got < 0 && errno == EINTR) {
+			continue;
+		} else if (got < 0) {
+			perror("Could not read console input");
+			ret = EXIT_FAILURE;
+			break;
+		}
+		/* at end of input, a cut off sequence is shown byte by byte */
+		const size_t len = carry + got;
+		carry = got == 0 ? 0 : utf8_incomplete(buf, len);
+		const char saved = buf[len - carry];
+		buf[len - carry] = '\0';
+		if (console_write(&con, buf, len - carry) != EXIT_SUCCESS) {
+			ret = EXIT_FAILURE;
+			break;
+		}
+		buf[len - carry] = saved;
+		memmove(buf, buf + len - carry, carry);
+		if (got == 0) {
+			break;
+		}
+		if (!input_ready(fd) || elapsed_ms(&con.drawn) >= CONSOLE_FRAME) {
+			console_draw(fb, &con);
+		}
+	}
+	console_draw(fb, &con);
+	if (con.pan && fb->mem != fb->vmem) {
+		/* leave screen on first page, where other actions draw */
+		memmove(fb->vmem, fb->mem, fb->size);
+		fb->mem = fb->vmem;
+		console_pan(fb);
+	}
+	free(con.glyphs);
+	free(buf);
+	return ret;
+}
+
+/*
+ * Parses hex color, 4 digits meaning RGB565 and anything else 24-bit RGB
+ * or, with 8 digits, ARGB. Alpha 00 is opaque, like the 24-bit form.
+ */
+static uint32_t parse_color(const char *str) {
+	const uint32_t color = strtoul(str, NULL, 16);
+	if (strncmp(str, "0x", 2) == 0) {
+		str += 2;
+	}
+	return strlen(str) == 4 ? rgb_565_to_888(color) : color;
+}
+
+/* Action and options of one draw, from command line or a batch line */
+struct command {
+	char *text;
+	int clear;
+	int sync;
+	int quit; /* daemon connections only */
+	int progress; /* percent, -1 for none */
+	char *image;
+	char *image_raw; /* NULL for PPM */
+	char *dump;
+	int dump_raw;
+	char *caption;
+	char *caption_color; /* NULL for default */
+	char *progress_state; /* NULL for in-process state only */
+	char *text_state; /* NULL for in-process state only */
+	char *text_color; /* NULL for default */
+	char *bg_color; /* NULL or empty for transparent */
+	char *font; /* NULL for built-in */
+	int scale;
+	int x;
+	int y;
+	int width;
+	int height;
+	char *halign;
+	char *valign;
+};
+
+static const struct command command_defaults = {
+	NULL, 0, 0, 0, -1, NULL, NULL, NULL, 0, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 1,
+	0, 0, 0, 0, NULL, NULL
+};
+
+/* Frees strings popt allocated for cmd over base and resets it to base */
+static void command_reset(struct command *cmd, const struct command *base) {
+	if (cmd->text != base->text) {
+		free(cmd->text);
+	}
+	if (cmd->text_color != base->text_color) {
+		free(cmd->text_color);
+	}
+	if (cmd->bg_color != base->bg_color) {
+		free(cmd->bg_color);
+	}
+	if (cmd->font != base->font) {
+		free(cmd->font);
+	}
+	if (cmd->halign != base->halign) {
+		free(cmd->halign);
+	}
+	if (cmd->valign != base->valign) {
+		free(cmd->valign);
+	}
+	if (cmd->image != base->image) {
+		free(cmd->image);
+	}
+	if (cmd->image_raw != base->image_raw) {
+		free(cmd->image_raw);
+	}
+	if (cmd->dump != base->dump) {
+		free(cmd->dump);
+	}
+	if (cmd->caption != base->caption) {
+		free(cmd->caption);
+	}
+	if (cmd->caption_color != base->caption_color) {
+		free(cmd->caption_color);
+	}
+	if (cmd->progress_state != base->progress_state) {
+		free(cmd->progress_state);
+	}
+	if (cmd->text_state != base->text_state) {
+		free(cmd->text_state);
+	}
+	*cmd = *base;
+}
+
+/* Draws cmd, which has exactly one action other than sync */
+static int fb_draw(struct fb *fb, const struct command *cmd) {
+	const bool bg_clear = cmd->bg_color != NULL && cmd->bg_color[0];
+	const uint32_t bg_color32 = parse_color(bg_clear ? cmd->bg_color : "0xFFFF");
+	const uint32_t fg_color32 = parse_color(cmd->text_color != NULL ?
+		cmd->text_color : "0x4E02");
+	/* text state names its font, so any action keeping it needs the font */
+	const bool text_state = cmd->text_state != NULL && cmd->dump == NULL;
+	/* other actions keep progress state too, so drawing over the bar forgets it */
+	const bool progress_state = cmd->progress_state != NULL && cmd->dump == NULL;
+	int ret;
+	if ((text_state || (!cmd->clear && cmd->image == NULL && cmd->dump == NULL)) &&
+			fb_set_font(fb, cmd->font) != EXIT_SUCCESS) {
+		return EXIT_FAILURE;
+	}
+	if (text_state) {
+		text_state_load(fb, cmd->text_state);
+	}
+	if (progress_state) {
+		progress_load(fb, cmd->progress_state);
+	}
+	if (cmd->progress >= 0) {
+		ret = fb_progress(fb, cmd->progress, cmd->x, cmd->y,
+			cmd->width, cmd->height, fg_color32, bg_color32, cmd->caption,
+			parse_color(cmd->caption_color != NULL ? cmd->caption_color : "0x0000"),
+			cmd->scale);
+	} else if (cmd->dump != NULL) {
+		ret = fb_dump(fb, cmd->dump, cmd->dump_raw, cmd->x, cmd->y,
+			cmd->width, cmd->height);
+	} else if (cmd->image != NULL) {
+		ret = fb_image(fb, cmd->image, cmd->image_raw, cmd->x, cmd->y,
+			cmd->halign, cmd->valign);
+	} else if (cmd->clear) {
+		/* Clear mode */
+		ret = fb_clear(fb, bg_color32, cmd->x, cmd->y, cmd->width, cmd->height);
+	} else {
+		/* Text mode */
+		ret = fb_write_text(fb, cmd->text, cmd->scale, bg_clear,
+			bg_color32, fg_color32, cmd->x, cmd->y, cmd->halign, cmd->valign);
+	}
+	/* even failed actions may have drawn something */
+	if (text_state) {
+		text_state_save(fb, cmd->text_state);
+	}
+	if (progress_state) {
+		progress_save(fb, cmd->progress_state);
+	}
+	return ret;
+}
 
-/* Converts 24-bit rgb color to 16-bit rgb */
-static inline uint16_t rgb_888_to_565(const uint32_t rgb888) {
-	return (uint16_t)(
-		(((rgb888 & 0xff0000) >> 8) & 0xf800) |
-		(((rgb888 & 0x00ff00) >> 5) & 0x07e0) |
-		(((rgb888 & 0x0000ff) >> 3) & 0x001f));
+/* Runs cmd, which has exactly one action, tracing drawing as render phase */
+static int fb_run(struct fb *fb, const struct command *cmd) {
+	if (cmd->sync) {
+		fb_flush(fb);
+		return EXIT_SUCCESS;
+	}
+	const uint64_t start = trace_now();
+	const int ret = fb_draw(fb, cmd);
+	const char *action = cmd->text != NULL ? "text" : cmd->clear ? "clear" :
+		cmd->progress >= 0 ? "progress" : cmd->image != NULL ? "image" : "dump";
+	if (ret == EXIT_SUCCESS) {
+		trace_end("render", action, start);
+	} else {
+		trace_error("render", action, "failed", start);
+	}
+	return ret;
 }
 
-/* Converts 16-bit rgb color to 24-bit rgb */
-static inline uint32_t rgb_565_to_888(const uint16_t rgb565) {
-	return (((uint32_t)rgb565 & 0x0000f800) << 8) |
-		(((uint32_t)rgb565 & 0x000007e0) << 5) |
-		(((uint32_t)rgb565 & 0x0000001f) << 3);
+/* Frames --animate draws per second unless told otherwise */
+#define ANIMATE_FPS 10
+/* Spinner glyphs unless given */
+#define SPINNER_GLYPHS "|/-\\"
+
+/*
+ * Fills text with frame of spinner glyphs, or of a countdown from seconds
+ * when glyphs is NULL, and returns whether the countdown is over.
+ */
+static bool animate_frame(char *text, const size_t size, const uint64_t frame,
+		const int fps, const char *glyphs, const long seconds) {
+	if (glyphs != NULL) {
+		const char *glyph = glyphs;
+		for (uint64_t i = frame % utf8_length(glyphs); i > 0; i--) {
+			utf8_next(&glyph);
+		}
+		const char *next = glyph;
+		utf8_next(&next);
+		snprintf(text, size, "%.*s", (int)(next - glyph), glyph);
+		return false;
+	}
+	const uint64_t elapsed = frame / fps;
+	const long left = elapsed < (uint64_t)seconds ? seconds - (long)elapsed : 0;
+	/* as wide as the first frame, so digits stay in their cells */
+	snprintf(text, size, "%*ld", snprintf(NULL, 0, "%ld", seconds), left);
+	return left == 0;
 }
 
 /*
- * Fills rectangular area with given color.
- * Expects coordinates and sizes to be validated and normalized.
+ * Animates spec, "spinner[:<glyphs>]" or "countdown:<seconds>", with text
+ * options of cmd at fps frames per second, until the countdown is over or
+ * SIGINT or SIGTERM arrives. Frames that look like the previous one cost
+ * nothing; others redraw only changed cells, presented in one flush timed
+ * to vertical blank where the display reports it and else only by frame
+ * timer. Frames missed while the system is busy are skipped, not queued.
  */
-static void fill(void *out, const struct fb *fb, const uint32_t color,
-		const int width, const int height) {
-	const uint16_t color16 = rgb_888_to_565(color);
-	for (int j = 0; j < height; j++) {
-		void *row_out = out;
-		for (int i = 0; i < width; i++) {
-			if (fb->depth == 2) {
-				*(uint16_t *)row_out = color16;
-			} else if (fb->depth == 4) {
-				*(uint32_t *)row_out = color;
-			} else {
-			  fprintf(stderr, "Cannot handle bit depth of %u\n", fb->depth);
-				abort();
+static int fb_animate(struct fb *fb, const char *spec, const int fps,
+		const struct command *cmd) {
+	const char *glyphs = NULL;
+	long seconds = 0;
+	char *end = NULL;
+	if (strcmp(spec, "spinner") == 0) {
+		glyphs = SPINNER_GLYPHS;
+	} else if (strncmp(spec, "spinner:", 8) == 0) {
+		glyphs = spec + 8;
+	} else if (strncmp(spec, "countdown:", 10) == 0) {
+		seconds = strtol(spec + 10, &end, 10);
+	}
+	if (glyphs != NULL ? glyphs[0] == '\0' :
+			end == NULL || end == spec + 10 || *end != '\0' || seconds < 0) {
+		fputs("Invalid animation, expected spinner[:<glyphs>] or countdown:<seconds>\n",
+			stderr);
+		return EXIT_FAILURE;
+	} else if (fps < 1 || fps > 100) {
+		fputs("Invalid frame rate\n", stderr);
+		return EXIT_FAILURE;
+	}
+	const uint32_t bg_color = parse_color(cmd->bg_color != NULL && cmd->bg_color[0] ?
+		cmd->bg_color : "0xFFFF");
+	const uint32_t fg_color = parse_color(cmd->text_color != NULL ?
+		cmd->text_color : "0x4E02");
+	sigset_t signals;
+	sigset_t old_signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	if (sigprocmask(SIG_BLOCK, &signals, &old_signals) != 0) {
+		perror("Could not block signals");
+		return EXIT_FAILURE;
+	}
+	const long interval = 1000000000L / fps;
+	const struct itimerspec timer = {
+		{interval / 1000000000L, interval % 1000000000L},
+		{interval / 1000000000L, interval % 1000000000L}
+	};
+	const int signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+	const int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	int ret = EXIT_SUCCESS;
+	if (signal_fd < 0 || timer_fd < 0 || timerfd_settime(timer_fd, 0, &timer, NULL) != 0) {
+		perror("Could not set up frame timer");
+		ret = EXIT_FAILURE;
+	}
+	bool vsync = fb->backend->wait_vsync != NULL;
+	bool done = false;
+	uint64_t frame = 0;
+	char shown[32] = "";
+	while (ret == EXIT_SUCCESS && !done) {
+		char text[sizeof(shown)];
+		done = animate_frame(text, sizeof(text), frame, fps, glyphs, seconds);
+		if (strcmp(text, shown) != 0) {
+			const uint64_t start = trace_now();
+			/* direct drawing must wait for blank, back buffers only their flush */
+			if (fb->present != FB_PRESENT_DIRECT) {
+				ret = fb_write_text(fb, text, cmd->scale, true, bg_color, fg_color,
+					cmd->x, cmd->y, cmd->halign, cmd->valign);
+			}
+			if (vsync && fb->backend->wait_vsync(fb) != EXIT_SUCCESS) {
+				/* pace by frame timer alone */
+				vsync = false;
 			}
-			row_out = (char *)row_out + fb->depth;
+			if (fb->present == FB_PRESENT_DIRECT) {
+				ret = fb_write_text(fb, text, cmd->scale, true, bg_color, fg_color,
+					cmd->x, cmd->y, cmd->halign, cmd->valign);
+			}
+			fb_flush(fb);
+			strcpy(shown, text);
+			trace_end("render", "animate", start);
+		}
+		struct pollfd fds[2] = {{timer_fd, POLLIN, 0}, {signal_fd, POLLIN, 0}};
+		uint64_t ticks;
+		struct signalfd_siginfo info;
+		if (ret != EXIT_SUCCESS || done) {
+			break;
+		} else if (poll(fds, 2, -1) < 0) {
+			if (errno != EINTR) {
+				perror("Could not wait for next frame");
+				ret = EXIT_FAILURE;
+			}
+		} else if (fds[1].revents) {
+			/* read, so it isn't delivered once unblocked */
+			done = read(signal_fd, &info, sizeof(info)) == sizeof(info);
+		} else if (fds[0].revents && read(timer_fd, &ticks, sizeof(ticks)) == sizeof(ticks)) {
+			frame += ticks;
 		}
-		out = (char *)out + fb->line_len;
 	}
+	if (timer_fd >= 0) {
+		close(timer_fd);
+	}
+	if (signal_fd >= 0) {
+		close(signal_fd);
+	}
+	sigprocmask(SIG_SETMASK, &old_signals, NULL);
+	return ret;
 }
 
-#define NONPRINTABLE 0xffc399bdbd99c3ffL
+/*
+ * Runs draw commands read from in, one per line, all against the same fb.
+ * Lines hold actions and options just like the command line; empty lines
+ * and lines starting with # are skipped. Each line starts from options
+ * given in cmd, normally those of the command line; nothing carries over
+ * between lines. Flushing happens at --sync lines and after the last line.
+ * A --quit line, if popts allow one, stops reading and sets *quit.
+ */
+static int fb_run_batch(struct fb *fb, FILE *in, const struct poptOption *popts,
+		struct command *cmd, bool *quit) {
+	char *line = NULL;
+	size_t line_size = 0;
+	unsigned int line_no = 0;
+	const struct command base = *cmd;
+	int ret = EXIT_SUCCESS;
+	while (ret == EXIT_SUCCESS && getline(&line, &line_size, in) != -1) {
+		++line_no;
+		const char *start = line + strspn(line, " \t\r\n");
+		if (*start == '\0' || *start == '#') {
+			continue;
+		}
+		int line_argc;
+		const char **line_argv;
+		if (poptParseArgvString(start, &line_argc, &line_argv) != 0) {
+			fprintf(stderr, "Batch line %u: Could not split arguments\n", line_no);
+			ret = EXIT_FAILURE;
+			break;
+		}
+		/* popt skips program name */
+		const char *args[line_argc + 1];
+		args[0] = "batch";
+		memcpy(args + 1, line_argv, line_argc * sizeof(*args));
+		poptContext ctx = poptGetContext(NULL, line_argc + 1, args, popts,
+			POPT_CONTEXT_NO_EXEC);
+		const int rc = poptGetNextOpt(ctx);
+		const int action_sum = (cmd->text == NULL ? 0 : 1) + cmd->clear + cmd->sync
+			+ cmd->quit + (cmd->progress < 0 ? 0 : 1) + (cmd->image == NULL ? 0 : 1)
+			+ (cmd->dump == NULL ? 0 : 1);
+		if (rc != -1) {
+			fprintf(stderr, "Batch line %u: %s: %s\n", line_no,
+				poptBadOption(ctx, POPT_BADOPTION_NOALIAS), poptStrerror(rc));
+			ret = EXIT_FAILURE;
+		} else if (poptPeekArg(ctx) != NULL || action_sum != 1) {
+			fprintf(stderr, "Batch line %u: Exactly one action and no device expected\n",
+				line_no);
+			ret = EXIT_FAILURE;
+		} else if (cmd->quit) {
+			*quit = true;
+		} else {
+			ret = fb_run(fb, cmd);
+		}
+		poptFreeContext(ctx);
+		free(line_argv);
+		command_reset(cmd, &base);
+		if (quit != NULL && *quit) {
+			break;
+		}
+	}
+	if (ret == EXIT_SUCCESS && ferror(in)) {
+		fprintf(stderr, "Batch line %u: Could not read: %s\n", line_no + 1,
+			strerror(errno));
+		ret = EXIT_FAILURE;
+	}
+	free(line);
+	return ret;
+}
 
-static const uint64_t alphabet[256] = {
-	NONPRINTABLE, NONPRINTABLE, NONPRINTABLE, NONPRINTABLE,
-	NONPRINTABLE, NONPRINTABLE, NONPRINTABLE, NONPRINTABLE,
-	NONPRINTABLE,/*\n*/NONPRINTABLE, NONPRINTABLE, NONPRINTABLE,
-	NONPRINTABLE, NONPRINTABLE, NONPRINTABLE, NONPRINTABLE,
-	NONPRINTABLE, NONPRINTABLE, NONPRINTABLE, NONPRINTABLE,
-	NONPRINTABLE, NONPRINTABLE, NONPRINTABLE, NONPRINTABLE,
-	NONPRINTABLE, NONPRINTABLE, NONPRINTABLE, NONPRINTABLE,
-	NONPRINTABLE, NONPRINTABLE, NONPRINTABLE, NONPRINTABLE,
-	/*space*/0,          0x000c000c1e1e1e0cL, 0x0000000000363636L, 0x0036367f367f3636L,
-	0x000c1f301e033e0cL, 0x0063660c18336300L, 0x006e333b6e1c361cL, 0x0000000000030606L,
-	0x00180c0606060c18L, 0x00060c1818180c06L, 0x0000663cff3c6600L, 0x00000c0c3f0c0c00L,
-	0x060c0c0000000000L, 0x000000003f000000L, 0x000c0c0000000000L, 0x000103060c183060L,
-	/*0*/0x3e676f7b73633eL,0x3f0c0c0c0c0e0cL, 0x003f33061c30331eL, 0x001e33301c30331eL,
-	0x0078307f33363c38L, 0x001e3330301f033fL, 0x001e33331f03061cL, 0x000c0c0c1830333fL,
-	0x001e33331e33331eL, 0x000e18303e33331eL, 0x000c0c00000c0c00L, 0x060c0c00000c0c00L,
-	0x00180c0603060c18L, 0x00003f00003f0000L, 0x00060c1830180c06L, 0x000c000c1830331eL,
-	0x1e037b7b7b633eL,/*A*/0x33333f33331e0cL, 0x003f66663e66663fL, 0x003c66030303663cL,
-	0x001f36666666361fL, 0x007e06061e06067eL, 0x000606061e06067eL, 0x007c66730303663cL,
-	0x003333333f333333L, 0x001e0c0c0c0c0c1eL, 0x001e333330303078L, 0x006766361e366667L,
-	0x007e060606060606L, 0x0063636b7f7f7763L, 0x006363737b6f6763L, 0x001c36636363361cL,
-	0x000f06063e66663fL, 0x00381e3b3333331eL, 0x006766363e66663fL, 0x001e33380e07331eL,
-	0x000c0c0c0c0c0c3fL, 0x003f333333333333L, 0x000c1e3333333333L, 0x0063777f6b636363L,
-	0x0063361c1c366363L, 0x001e0c0c1e333333L, 0x007f060c1830607fL, 0x001e06060606061eL,
-	0x00406030180c0603L, 0x001e18181818181eL, 0x0000000063361c08L, 0xff00000000000000L,
-	0x000000180c0cL,/*a*/0x006e333e301e0000L, 0x003b66663e060607L, 0x001e3303331e0000L,
-	0x006e33333e303038L, 0x001e033f331e0000L, 0x000f06060f06361cL, 0x1f303e33336e0000L,
-	0x006766666e360607L, 0x001e0c0c0c0e000cL, 0x1e33333030300030L, 0x0067361e36660607L,
-	0x001e0c0c0c0c0c0eL, 0x00636b7f7f330000L, 0x00333333331f0000L, 0x001e3333331e0000L,
-	0x0f063e66663b0000L, 0x78303e33336e0000L, 0x000f06666e3b0000L, 0x001f301e033e0000L,
-	0x00182c0c0c3e0c08L, 0x006e333333330000L, 0x000c1e3333330000L, 0x00367f7f6b630000L,
-	0x0063361c36630000L, 0x1f303e3333330000L, 0x003f260c193f0000L, 0x00380c0c070c0c38L,
-	0x0018181800181818L, 0x00070c0c380c0c07L, 0x0000000000003b6eL, NONPRINTABLE,
-	/* TODO: add higher 128 chars? But what encoding? */
+/* Patch file start, see struct patch_header */
+#define PATCH_MAGIC "T2SPATCH"
+#define PATCH_VERSION 1
+/* Op word bits holding the op, the pixel count is above them */
+#define PATCH_OP_BITS 2
+
+enum patch_op {
+	PATCH_SKIP,
+	PATCH_FILL,
+	PATCH_COPY
 };
 
 /*
- * Writes letters on screen. Each letter is represented as 8x8 bit matrix.
- * Known limitations:
- *  - ASCII only.
- *  - Doesn't handle \n for force line breaks.
- *    Could be done, but complicates limits calculation and wrapping.
- *  - Expects letters to fit square area. Could be fixed to allow rectangular.
- *  - Doesn't accept coordinates and alignment at the same time.
+ * Screen pre-rendered by text2screen-splash for one geometry and pixel
+ * format, in the byte order of the machine that compiled it. Followed by
+ * the batch script it was compiled from and by ops: 32-bit words of
+ * count << PATCH_OP_BITS | op, a FILL word followed by its pixel in four
+ * bytes and a COPY word by count pixels padded to four bytes. Ops run
+ * through the screen in reading order, SKIP leaving pixels as they are;
+ * FILL and COPY never cross the end of a row.
  */
-static int fb_write_text(
-		struct fb *fb,
-		const char *text,
-		const int scale,
-		bool bg_clear,
-		const uint32_t bg_color,
-		const uint32_t fg_color,
-		int x,
-		int y,
-		const char *halign,
-		const char *valign) {
-	if (scale < 1) {
-		fputs("Invalid scale\n", stderr);
-		return EXIT_FAILURE;
-	}
-	const unsigned int space_size = scale * 2;
-	const unsigned int letter_size = scale * 8;
-	const unsigned int max_chars_per_row = fb->width / letter_size;
-	const unsigned int row_height = space_size + letter_size;
-	const size_t len = strlen(text);
+struct patch_header {
+	char magic[8];
+	uint32_t version; /* PATCH_VERSION, also telling byte order apart */
+	uint32_t width;
+	uint32_t height;
+	uint32_t depth; /* bytes per pixel */
+	struct fb_channel channels[3]; /* red, green, blue */
+	uint8_t reserved[2];
+	uint32_t script_offset;
+	uint32_t script_size;
+	uint32_t ops_offset; /* multiple of 4 */
+	uint32_t ops_size;
+};
 
-	if (x != 0 && halign != NULL) {
-		fputs("You can't specify -H and -x at the same time\n", stderr);
-		return EXIT_FAILURE;
-	} else if (y != 0 && valign != NULL) {
-		fputs("You can't specify -V and -y at the same time\n", stderr);
-		return EXIT_FAILURE;
+/* Runs ops of a patch matching fb's geometry, damaging what they drew */
+static int patch_apply(struct fb *fb, const uint8_t *ops, const size_t size) {
+	const size_t pixels = (size_t)fb->width * fb->height;
+	size_t pos = 0;
+	int top = fb->height;
+	int bottom = 0;
+	int left = fb->width;
+	int right = 0;
+	bool ok = true;
+	for (size_t i = 0; ok && i < size; ) {
+		uint32_t word;
+		memcpy(&word, ops + i, sizeof(word));
+		i += sizeof(word);
+		const size_t count = word >> PATCH_OP_BITS;
+		const uint32_t op = word & ((1U << PATCH_OP_BITS) - 1);
+		if (op == PATCH_SKIP) {
+			pos += count;
+			continue;
+		}
+		const int x = pos % fb->width;
+		const int y = pos / fb->width;
+		const size_t data = op == PATCH_FILL ? 4 : (count * fb->depth + 3) & ~(size_t)3;
+		ok = (op == PATCH_FILL || op == PATCH_COPY) && pos < pixels && count > 0 &&
+			count <= (size_t)(fb->width - x) && data <= size - i;
+		if (!ok) {
+			break;
+		}
+		uint8_t *out = (uint8_t *)fb->mem + (size_t)y * fb->line_len + (size_t)x * fb->depth;
+		if (op == PATCH_FILL) {
+			uint32_t pixel = 0;
+			memcpy(&pixel, ops + i, fb->depth);
+			fb->span(out, pixel, count);
+		} else {
+			memcpy(out, ops + i, count * fb->depth);
+		}
+		i += data;
+		pos += count;
+		top = y < top ? y : top;
+		bottom = y + 1;
+		left = x < left ? x : left;
+		right = x + (int)count > right ? x + (int)count : right;
 	}
-
-	const unsigned int first_line_len = len > max_chars_per_row ? max_chars_per_row : len;
-	if (halign == NULL || strcmp(halign, "left") == 0) {
-		/* noop */
-	} else if (strcmp(halign, "right") == 0) {
-		x = fb->width - first_line_len * letter_size;
-	} else if (strcmp(halign, "center") == 0) {
-		x = (fb->width - first_line_len * letter_size) / 2;
-	} else {
-		fputs("Invalid horizontal alignment\n", stderr);
-		return EXIT_FAILURE;
+	if (top < bottom) {
+		fb_damage(fb, left, top, right - left, bottom - top);
 	}
-	const unsigned int rows_in_text = (len + max_chars_per_row - 1) / max_chars_per_row;
-	if (valign == NULL || strcmp(valign, "top") == 0) {
-		/* noop */
-	} else if (strcmp(valign, "center") == 0) {
-		y = (fb->height - row_height * rows_in_text) / 2;
-	} else if (strcmp(valign, "bottom") == 0) {
-		y = fb->height - row_height * rows_in_text;
-	} else {
-		fputs("Invalid vertical alignment\n", stderr);
+	if (!ok) {
+		fputs("Invalid or truncated patch\n", stderr);
 		return EXIT_FAILURE;
 	}
+	return EXIT_SUCCESS;
+}
 
-	if (x < 0 || x > fb->width || y < 0 || y > fb->width) {
-		fputs("Out of screen bounds\n", stderr);
+/*
+ * Shows patch file at path: its ops are applied straight to the buffer
+ * when it was compiled for fb's geometry and pixel format, else its
+ * script is run like a --batch file with popts and cmd.
+ */
+static int fb_patch(struct fb *fb, const char *path, const struct poptOption *popts,
+		struct command *cmd) {
+	const int fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		perror("Could not open patch");
+		if (fd >= 0) {
+			close(fd);
+		}
 		return EXIT_FAILURE;
 	}
-
-	const unsigned int max_rows = (fb->height - y) / row_height;
-	if (len > (max_rows - 1) * max_chars_per_row + (fb->width - x) / letter_size) {
-		fputs("Text is too long\n", stderr);
+	const size_t size = st.st_size;
+	struct patch_header header;
+	const uint8_t *data = size >= sizeof(header) ?
+		mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (data == MAP_FAILED) {
+		fputs("Invalid or truncated patch\n", stderr);
 		return EXIT_FAILURE;
 	}
-
-	uint8_t *screen_out = (uint8_t *)fb->mem;
-	/* Pointer to left top letter corner */
-	uint8_t *letter_out = screen_out + fb->line_len * y + fb->depth * x;
-	unsigned int row = 0;
-	/* Iterate over chars in text */
-	for (size_t c = 0; c < len; ++c) {
-		const uint64_t letter = alphabet[(unsigned char)text[c]];
-		/* Pointer to left top pixel corner */
-		uint8_t *pxly_out = letter_out;
-		/* Vertical letter axis */
-		for (int ly = 0; ly < 8; ++ly) {
-			uint8_t *pxlx_out = pxly_out;
-			/* Horizontal letter axis */
-			for (int lx = 0; lx < 8; ++lx) {
-				if (letter >> (ly * 8 + lx) & 1) {
-					fill(pxlx_out, fb, fg_color, scale, scale);
-				} else if (bg_clear) {
-					fill(pxlx_out, fb, bg_color, scale, scale);
-				}
-				/* Advance to next pixel */
-				pxlx_out += fb->depth * scale;
-			}
-			/* Advance to next pixel row */
-			pxly_out += fb->line_len * scale;
+	memcpy(&header, data, sizeof(header));
+	int ret = EXIT_FAILURE;
+	if (memcmp(header.magic, PATCH_MAGIC, sizeof(header.magic)) != 0 ||
+			header.version != PATCH_VERSION ||
+			(uint64_t)header.script_offset + header.script_size > size ||
+			(uint64_t)header.ops_offset + header.ops_size > size ||
+			header.ops_offset % 4 != 0 || header.ops_size % 4 != 0) {
+		fputs("Invalid patch or one of another version or byte order\n", stderr);
+	} else if (header.width == (uint32_t)fb->width && header.height == (uint32_t)fb->height &&
+			header.depth == fb->depth &&
+			memcmp(header.channels, fb->format.channels, sizeof(header.channels)) == 0) {
+		const uint64_t start = trace_now();
+		ret = patch_apply(fb, data + header.ops_offset, header.ops_size);
+		if (ret == EXIT_SUCCESS) {
+			trace_end("render", "patch", start);
+		} else {
+			trace_error("render", "patch", "failed", start);
 		}
-		/* Advance to next letter in same row */
-		letter_out += fb->depth * letter_size;
-		const int last_letter_in_row = fb->line_len * (y + row_height * row) +
-					       fb->depth * (fb->width - letter_size);
-		if (letter_out - screen_out > last_letter_in_row) {
-			++row;
-			letter_out = screen_out + fb->line_len * (y + row_height * row);
+	} else {
+		/* compiled for another screen, the script draws it here too */
+		FILE *in = header.script_size > 0 ?
+			fmemopen((void *)(uintptr_t)(data + header.script_offset),
+				header.script_size, "r") : NULL;
+		if (in == NULL) {
+			fputs("Patch doesn't fit the screen and has no script\n", stderr);
+		} else {
+			ret = fb_run_batch(fb, in, popts, cmd, NULL);
+			fclose(in);
 		}
 	}
-	return EXIT_SUCCESS;
+	munmap((void *)(uintptr_t)data, size);
+	return ret;
 }
 
-static int fb_init(struct fb *fb) {
-	struct fb_var_screeninfo vinfo;
-	struct fb_fix_screeninfo finfo;
-	if ((fb->fd = open(fb->device, O_RDWR)) < 0) {
-		perror("Could not open device");
+/* Seconds a daemon client may go without sending, before it is dropped */
+#define SERVE_TIMEOUT 5
+
+/* Fills addr with Unix socket path, failing if it doesn't fit */
+static int socket_address(struct sockaddr_un *addr, const char *path) {
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		fputs("Socket path is too long\n", stderr);
 		return EXIT_FAILURE;
 	}
-	if (ioctl(fb->fd, FBIOGET_FSCREENINFO, &finfo)) {
-		perror("Could not ioctl(FBIOGET_FSCREENINFO)");
-		close(fb->fd);
+	strcpy(addr->sun_path, path);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Keeps fb open and runs batches of commands sent to Unix socket at path.
+ * Each connection sends batch lines and shuts down its writing side; the
+ * lines are run, damage is flushed once and a status line, "0" on success,
+ * is sent back. A connection that sends nothing for SERVE_TIMEOUT seconds
+ * is dropped with status "1", so a stuck client can't block later ones.
+ * The calling process exits once socket is ready; serving continues in a
+ * background process until a connection sends --quit.
+ */
+static int fb_serve(struct fb *fb, const char *path, const struct poptOption *popts,
+		struct command *cmd) {
+	struct sockaddr_un addr;
+	if (socket_address(&addr, path) != EXIT_SUCCESS) {
 		return EXIT_FAILURE;
 	}
-	if (ioctl(fb->fd, FBIOGET_VSCREENINFO, &vinfo)){
-		perror("Could not ioctl(FBIOGET_VSCREENINFO)");
-		close(fb->fd);
+	/* a daemon still accepting keeps its socket, it sees an empty batch */
+	const int probe_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	const bool running = probe_fd >= 0 &&
+		connect(probe_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+	if (probe_fd >= 0) {
+		close(probe_fd);
+	}
+	if (running) {
+		fprintf(stderr, "A daemon is already running on %s\n", path);
 		return EXIT_FAILURE;
 	}
-	fb->size = finfo.line_length * vinfo.yres;
-	fb->width = vinfo.xres;
-	fb->height = vinfo.yres;
-	fb->depth = ((vinfo.bits_per_pixel) >> 3);
-	fb->line_len = finfo.line_length;
-	/* move viewport to upper left corner */
-	if (vinfo.xoffset != 0 || vinfo.yoffset != 0) {
-		vinfo.xoffset = 0;
-		vinfo.yoffset = 0;
-		if (ioctl(fb->fd, FBIOPAN_DISPLAY, &vinfo)) {
-			perror("Could not ioctl(FBIOPAN_DISPLAY)");
-			close(fb->fd);
-			return EXIT_FAILURE;
-		}
+	const int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0) {
+		perror("Could not create socket");
+		return EXIT_FAILURE;
 	}
-	fb->mem = mmap(0, fb->size, PROT_WRITE, MAP_SHARED, fb->fd, 0);
-	if (fb->mem == MAP_FAILED) {
-		perror("Could not mmap device");
-		close(fb->fd);
+	/* socket left behind by a daemon that didn't quit */
+	unlink(path);
+	if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+			listen(listen_fd, 8) != 0) {
+		perror("Could not listen on socket");
+		close(listen_fd);
 		return EXIT_FAILURE;
 	}
-	return EXIT_SUCCESS;
-}
-
-static void fb_destroy(struct fb *fb) {
-	if (fb->fd) {
-		munmap(fb->mem, fb->size);
-		close(fb->fd);
-		fb->mem = NULL;
+	/* threads don't survive fork(), so workers are started again in the daemon */
+	const int threads = fb->threads;
+	fb_pool_free(fb->pool);
+	fb->pool = NULL;
+	if (daemon(0, 1) != 0) {
+		perror("Could not daemonize");
+		close(listen_fd);
+		unlink(path);
+		return EXIT_FAILURE;
 	}
-}
-
-static void fb_flush(struct fb *fb) {
-	struct omapfb_update_window update;
-	if (fb->mem) {
-		update.x = 0;
-		update.y = 0;
-		update.width = fb->width;
-		update.height = fb->height;
-		/* TODO: there ain't OMAPFB_COLOR_RGB888 for 24-bit color */
-		update.format = OMAPFB_COLOR_RGB565;
-		update.out_x = 0;
-		update.out_y = 0;
-		update.out_width = fb->width;
-		update.out_height = fb->height;
-		if (ioctl(fb->fd, OMAPFB_UPDATE_WINDOW, &update) < 0) {
-//			perror("Could not ioctl(OMAPFB_UPDATE_WINDOW)");
+	fb->threads = threads;
+	fb_pool_start(fb);
+	/* clients going away before reading status must not kill us */
+	signal(SIGPIPE, SIG_IGN);
+	bool quit = false;
+	while (!quit) {
+		const int fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			continue;
+		}
+		const struct timeval timeout = {SERVE_TIMEOUT, 0};
+		if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0) {
+			perror("Could not set client timeout");
 		}
+		FILE *in = fdopen(fd, "r");
+		if (in == NULL) {
+			close(fd);
+			continue;
+		}
+		const int ret = fb_run_batch(fb, in, popts, cmd, &quit);
+		fb_flush(fb);
+		const char *status = ret == EXIT_SUCCESS ? "0\n" : "1\n";
+		if (write(fd, status, 2) != 2) {
+			/* client didn't wait for status */
+		}
+		fclose(in);
 	}
+	close(listen_fd);
+	unlink(path);
+	return EXIT_SUCCESS;
 }
 
-/* Normalizes coordinates (fixes negative width/height) */
-static void normalize(int *x, int *y, int *width, int *height) {
-	if (*width < 0) {
-		*width = -*width;
-		*x -= *width;
+/*
+ * Sends one command, or all lines of stdin for -, to daemon listening
+ * at path and returns the status it reports. Doesn't touch framebuffer.
+ */
+static int send_command(const char *path, const char *command) {
+	struct sockaddr_un addr;
+	if (socket_address(&addr, path) != EXIT_SUCCESS) {
+		return EXIT_FAILURE;
 	}
-	if (*height < 0) {
-		*height = -*height;
-		*y -= *height;
+	const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("Could not create socket");
+		return EXIT_FAILURE;
 	}
-}
-
-static int fb_clear(struct fb *fb, const uint32_t color, int x, int y,
-		int width, int height) {
-	if (width == 0) {
-		width = fb->width - x;
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		perror("Could not connect to daemon");
+		close(fd);
+		return EXIT_FAILURE;
 	}
-	if (height == 0) {
-		height = fb->height - y;
+	bool sent;
+	if (strcmp(command, "-") == 0) {
+		char buf[4096];
+		ssize_t len;
+		sent = true;
+		while (sent && (len = read(STDIN_FILENO, buf, sizeof(buf))) > 0) {
+			sent = write(fd, buf, len) == len;
+		}
+	} else {
+		const ssize_t len = strlen(command);
+		sent = write(fd, command, len) == len && write(fd, "\n", 1) == 1;
 	}
-	normalize(&x, &y, &width, &height);
-	if (x < 0 || x + width > fb->width || y < 0 || y + height > fb->height) {
-		fputs("Boundaries out of range\n", stderr);
-		return EXIT_FAILURE;
+	char status = '1';
+	if (!sent) {
+		perror("Could not send command");
+	} else if (shutdown(fd, SHUT_WR) != 0 || read(fd, &status, 1) != 1) {
+		perror("Could not read daemon status");
+		status = '1';
 	}
-	uint8_t *out = (uint8_t *)fb->mem + (ptrdiff_t)(fb->line_len * y + fb->depth * x);
-
-	fill(out, fb, color, width, height);
-	return EXIT_SUCCESS;
+	close(fd);
+	return status == '0' ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
+#ifndef TEXT2SCREEN_NO_MAIN
 int main(int argc, const char *argv[]) {
-	char *text = NULL;
+	struct command cmd = command_defaults;
 	int version = 0;
-	int clear = 0;
+	char *batch = NULL;
+	char *console = NULL;
+	char *animate = NULL;
+	char *patch = NULL;
+	int serve = 0;
+	char *send = NULL;
 	const struct poptOption actions[] = {
-		{"set-text", 't', POPT_ARG_STRING, &text, 0, "Write text on screen", "<text>"},
-		{"clear", 'c', POPT_ARG_NONE, &clear, 0, "Clear screen or its part", NULL},
+		{"set-text", 't', POPT_ARG_STRING, &cmd.text, 0, "Write text on screen", "<text>"},
+		{"clear", 'c', POPT_ARG_NONE, &cmd.clear, 0, "Clear screen or its part", NULL},
+		{"progress", 'p', POPT_ARG_INT, &cmd.progress, 0,
+			"Draw progress bar filled with text color, redrawing only what changed",
+			"{0-100}"},
+		{"image", 'i', POPT_ARG_STRING, &cmd.image, 0,
+			"Draw binary PPM or, with --image-raw, raw image file", "<file>"},
+		{"dump", 'd', POPT_ARG_STRING, &cmd.dump, 0,
+			"Save screen or its part as binary PPM, - for stdout", "<file>"},
+		{"batch", 0, POPT_ARG_STRING, &batch, 0,
+			"Run actions listed one per line in file, - for stdin", "<file>"},
+		{"sync", 0, POPT_ARG_NONE, &cmd.sync, 0,
+			"Flush screen (batch lines only)", NULL},
+		{"console", 0, POPT_ARG_STRING, &console, 0,
+			"Show text read from file, - for stdin, scrolling as it comes", "<file>"},
+		{"animate", 0, POPT_ARG_STRING, &animate, 0,
+			"Draw spinner until killed or count seconds down",
+			"spinner[:<glyphs>]|countdown:<seconds>"},
+		{"patch", 0, POPT_ARG_STRING, &patch, 0,
+			"Show screen compiled by text2screen-splash, or draw its script"
+			" if compiled for another screen", "<file>"},
+		{"daemon", 0, POPT_ARG_NONE, &serve, 0,
+			"Keep screen open, running batch lines sent to socket", NULL},
+		{"send", 0, POPT_ARG_STRING, &send, 0,
+			"Send batch line, or stdin for -, to daemon", "<command>"},
+		{"quit", 0, POPT_ARG_NONE, &cmd.quit, 0,
+			"Stop daemon (daemon commands only)", NULL},
 		{"version", 0, POPT_ARG_NONE, &version, 0, "Output version", NULL},
 		POPT_TABLEEND
 	};
 
-	const char *text_color = "0x4E02";
-	const char *bg_color = "";
-	int scale = 1;
-	int x = 0;
-	int y = 0;
-	int width = 0;
-	int height = 0;
-	char *halign = NULL;
-	char *valign = NULL;
+	char *back_buffer = NULL;
+	int threads = 1;
+	int rotate = 0;
+	int fps = ANIMATE_FPS;
+	const char *socket_path = "/run/text2screen.sock";
 	const struct poptOption options[] = {
-		{"set-text-color", 'T', POPT_ARG_STRING, &text_color, 0,
-			"Use specified 24bit or 32bit RGB color for text. Default is 0x4E02 (green).", "<color>"},
-		{"set-bg-color", 'B', POPT_ARG_STRING, &bg_color, 0,
-			"Use specified 24bit or 32bit RGB color for background. Default is 0xFFFF (white).", "<color>"},
-		{"set-scale", 's', POPT_ARG_INT, &scale, 0,
+		{"set-text-color", 'T', POPT_ARG_STRING, &cmd.text_color, 0,
+			"Use specified RGB565, 24bit RGB or 32bit ARGB color for text. Default is 0x4E02 (green).", "<color>"},
+		{"set-bg-color", 'B', POPT_ARG_STRING, &cmd.bg_color, 0,
+			"Use specified RGB565, 24bit RGB or 32bit ARGB color for background. Default is 0xFFFF (white).", "<color>"},
+		{"set-scale", 's', POPT_ARG_INT, &cmd.scale, 0,
 			"Set text size", "{1-10}"},
-		{"set-x", 'x', POPT_ARG_INT, &x, 0, "Text/clear area x-coordinate", "<int>"},
-		{"set-y", 'y', POPT_ARG_INT, &y, 0, "Text/clear area y-coordinate", "<int>"},
-		{"set-width", 'w', POPT_ARG_INT, &width, 0, "Clear area width", "<int>"},
-		{"set-height", 'h', POPT_ARG_INT, &height, 0, "Clear area height", "<int>"},
-		{"set-halign", 'H', POPT_ARG_STRING, &halign, 0,
+		{"font", 'f', POPT_ARG_STRING, &cmd.font, 0,
+			"Draw text in PSF1 or PSF2 console font. Default is built-in 8x8 font", "<file>"},
+		{"set-x", 'x', POPT_ARG_INT, &cmd.x, 0, "Text/clear area x-coordinate", "<int>"},
+		{"set-y", 'y', POPT_ARG_INT, &cmd.y, 0, "Text/clear area y-coordinate", "<int>"},
+		{"set-width", 'w', POPT_ARG_INT, &cmd.width, 0, "Clear area width", "<int>"},
+		{"set-height", 'h', POPT_ARG_INT, &cmd.height, 0, "Clear area height", "<int>"},
+		{"set-halign", 'H', POPT_ARG_STRING, &cmd.halign, 0,
 			"Horizontal aligment", "{left|center|right}"},
-		{"set-valign", 'V', POPT_ARG_STRING, &valign, 0,
+		{"set-valign", 'V', POPT_ARG_STRING, &cmd.valign, 0,
 			"Vertical aligment", "{top|center|bottom}"},
+		{"caption", 0, POPT_ARG_STRING, &cmd.caption, 0,
+			"Text centered on progress bar", "<text>"},
+		{"set-caption-color", 0, POPT_ARG_STRING, &cmd.caption_color, 0,
+			"Use specified color for caption. Default is 0x0000 (black).", "<color>"},
+		{"image-raw", 0, POPT_ARG_STRING, &cmd.image_raw, 0,
+			"Image is raw RGB565 or XRGB8888 of given geometry",
+			"<width>x<height>x{16|32}[,stride=<bytes>]"},
+		{"dump-raw", 0, POPT_ARG_NONE, &cmd.dump_raw, 0,
+			"Dump pixels as they are in video memory, rows packed", NULL},
+		{"progress-state", 0, POPT_ARG_STRING, &cmd.progress_state, 0,
+			"Remember progress bar between runs in file, e.g. under /run", "<file>"},
+		{"text-state", 0, POPT_ARG_STRING, &cmd.text_state, 0,
+			"Remember text on screen between runs in file, e.g. under /run", "<file>"},
+		POPT_TABLEEND
+	};
+	/* set up the screen once per process, so batch lines can't give them */
+	const struct poptOption screen_options[] = {
+		{"back-buffer", 'b', POPT_ARG_STRING, &back_buffer, 0,
+			"Draw off-screen, then copy damaged rows or flip pages", "{copy|flip}"},
+		{"threads", 'j', POPT_ARG_INT, &threads, 0,
+			"Draw large areas in bands on this many threads. Default is 1", "{1-16}"},
+		{"rotate", 'r', POPT_ARG_INT, &rotate, 0,
+			"Turn everything drawn clockwise, e.g. for a screen held in portrait",
+			"{0|90|180|270}"},
+		{"socket", 'S', POPT_ARG_STRING, &socket_path, 0,
+			"Daemon socket. Default is /run/text2screen.sock", "<path>"},
+		{"fps", 0, POPT_ARG_INT, &fps, 0,
+			"Animation frames per second. Default is 10", "{1-100}"},
 		POPT_TABLEEND
 	};
 	const struct poptOption popts[] = {
 		{NULL, 0, POPT_ARG_INCLUDE_TABLE, &actions, 0, "Actions:", NULL},
 		{NULL, 0, POPT_ARG_INCLUDE_TABLE, &options, 0, "Options:", NULL},
+		{NULL, 0, POPT_ARG_INCLUDE_TABLE, &screen_options, 0, "Screen options:", NULL},
 		POPT_AUTOHELP
 		POPT_TABLEEND
 	};
+	/* batch lines may only give draw actions and their options */
+	const struct poptOption batch_options[] = {
+		{"set-text", 't', POPT_ARG_STRING, &cmd.text, 0, NULL, NULL},
+		{"clear", 'c', POPT_ARG_NONE, &cmd.clear, 0, NULL, NULL},
+		{"progress", 'p', POPT_ARG_INT, &cmd.progress, 0, NULL, NULL},
+		{"image", 'i', POPT_ARG_STRING, &cmd.image, 0, NULL, NULL},
+		{"dump", 'd', POPT_ARG_STRING, &cmd.dump, 0, NULL, NULL},
+		{"sync", 0, POPT_ARG_NONE, &cmd.sync, 0, NULL, NULL},
+		{NULL, 0, POPT_ARG_INCLUDE_TABLE, &options, 0, NULL, NULL},
+		POPT_TABLEEND
+	};
+	const struct poptOption daemon_options[] = {
+		{"quit", 0, POPT_ARG_NONE, &cmd.quit, 0, NULL, NULL},
+		{NULL, 0, POPT_ARG_INCLUDE_TABLE, &batch_options, 0, NULL, NULL},
+		POPT_TABLEEND
+	};
+	trace_init("text2screen");
+	const uint64_t parse_start = trace_now();
 	poptContext ctx = poptGetContext(NULL, argc, argv, popts, POPT_CONTEXT_NO_EXEC);
 	poptSetOtherOptionHelp(ctx, "[OPTION...] ACTION [DEVICE]");
 	int rc = poptGetNextOpt(ctx);
+	trace_end("parse", NULL, parse_start);
 	int ret = EXIT_FAILURE;
 	if (rc == -1) {
-		struct fb fb = {"/dev/fb0", 0, 0, 0, 0, NULL, 0, 0};
+		struct fb fb = {.device = "/dev/fb0"};
 		/* TODO: fail if more than one non-option arg is given. */
 		if (poptPeekArg(ctx) != NULL) {
 			fb.device = poptGetArg(ctx);
 		}
-		const int action_sum = (text == NULL ? 0 : 1) + clear + version;
+		const int action_sum = (cmd.text == NULL ? 0 : 1) + cmd.clear + cmd.sync
+			+ (cmd.progress < 0 ? 0 : 1) + (cmd.image == NULL ? 0 : 1)
+			+ (cmd.dump == NULL ? 0 : 1)
+			+ (batch == NULL ? 0 : 1) + (console == NULL ? 0 : 1)
+			+ (animate == NULL ? 0 : 1) + (patch == NULL ? 0 : 1) + serve + (send == NULL ? 0 : 1)
+			+ cmd.quit + version;
+		FILE *in = NULL;
+		int console_fd = STDIN_FILENO;
 		if (action_sum > 1) {
 			/* More than one action at a time */
 			fputs("Only one action can be given\n", stderr);
@@ -407,37 +4102,69 @@ int main(int argc, const char *argv[]) {
 				"This is free software: you are free to change and redistribute it.\n"
 				"There is NO WARRANTY, to the extent permitted by law.");
 			ret = EXIT_SUCCESS;
+		} else if (cmd.sync) {
+			fputs("--sync is only valid in batch files\n", stderr);
+		} else if (cmd.quit) {
+			fputs("--quit is only valid in daemon commands\n", stderr);
+		} else if (send != NULL) {
+			ret = send_command(socket_path, send);
+		} else if (back_buffer != NULL && strcmp(back_buffer, "copy") != 0
+				&& strcmp(back_buffer, "flip") != 0) {
+			fputs("Invalid back buffer mode\n", stderr);
+		} else if (rotate != 0 && rotate != 90 && rotate != 180 && rotate != 270) {
+			fputs("Invalid rotation, expected 0, 90, 180 or 270\n", stderr);
+		} else if (batch != NULL && strcmp(batch, "-") != 0
+				&& (in = fopen(batch, "r")) == NULL) {
+			perror("Could not open batch file");
+		} else if (console != NULL && strcmp(console, "-") != 0
+				&& (console_fd = open(console, O_RDONLY)) < 0) {
+			perror("Could not open console input");
 		} else {
+			fb.threads = threads;
+			fb.rotate = rotate;
+			/* dump what is shown, even a page flipped to by another program */
+			fb.keep_view = cmd.dump != NULL;
+			if (back_buffer != NULL) {
+				fb.present = strcmp(back_buffer, "flip") == 0 ?
+					FB_PRESENT_FLIP : FB_PRESENT_COPY;
+			}
 			ret = fb_init(&fb);
 			if (ret == EXIT_SUCCESS) {
-				const char *bg_colorstr = bg_color[0] ? bg_color : "0xFFFF";
-				uint32_t bg_color32 = strtoul(bg_colorstr, NULL, 16);
-				uint32_t fg_color32 = strtoul(text_color, NULL, 16);
-				const char *ptr = bg_colorstr;
-				if (strncmp(ptr, "0x", 2) == 0) {
-					ptr += 2;
-				}
-				if (strlen(ptr) == 4) {
-					bg_color32 = rgb_565_to_888(bg_color32);
-				}
-				ptr = text_color;
-				if (strncmp(ptr, "0x", 2) == 0) {
-					ptr += 2;
-				}
-				if (strlen(ptr) == 4) {
-					fg_color32 = rgb_565_to_888(fg_color32);
-				}
-				if (clear) {
-					/* Clear mode */
-					ret = fb_clear(&fb, bg_color32, x, y, width, height);
+				if (serve) {
+					ret = fb_serve(&fb, socket_path, daemon_options, &cmd);
+				} else if (batch != NULL) {
+					ret = fb_run_batch(&fb, in != NULL ? in : stdin,
+						batch_options, &cmd, NULL);
+				} else if (console != NULL) {
+					const bool bg_clear = cmd.bg_color != NULL && cmd.bg_color[0];
+					ret = fb_set_font(&fb, cmd.font);
+					if (ret == EXIT_SUCCESS) {
+						ret = fb_console(&fb, console_fd, cmd.scale,
+							parse_color(bg_clear ? cmd.bg_color : "0xFFFF"),
+							parse_color(cmd.text_color != NULL ?
+								cmd.text_color : "0x4E02"),
+							cmd.y, cmd.height);
+					}
+				} else if (animate != NULL) {
+					ret = fb_set_font(&fb, cmd.font);
+					if (ret == EXIT_SUCCESS) {
+						ret = fb_animate(&fb, animate, fps, &cmd);
+					}
+				} else if (patch != NULL) {
+					ret = fb_patch(&fb, patch, batch_options, &cmd);
 				} else {
-					/* Text mode */
-					ret = fb_write_text(&fb, text, scale, bg_color[0], bg_color32, fg_color32, x, y, halign, valign);
+					ret = fb_run(&fb, &cmd);
 				}
 				fb_flush(&fb);
 			}
 			fb_destroy(&fb);
 		}
+		if (in != NULL) {
+			fclose(in);
+		}
+		if (console_fd != STDIN_FILENO && console_fd >= 0) {
+			close(console_fd);
+		}
 	} else {
 		/* Invalid option */
 		fprintf(stderr, "%s: %s\n",
@@ -447,3 +4174,4 @@ int main(int argc, const char *argv[]) {
 	poptFreeContext(ctx);
 	return ret;
 }
+#endif
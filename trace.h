@@ -0,0 +1,97 @@
+/*
+	trace.h - opt-in phase timing shared by initrd-progs tools
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Setting INITRD_TRACE to a file name, e.g. under /run, or to - for stderr
+ * makes tools append one line per finished phase:
+ *
+ *   <tool> <pid> <phase> <start us> <duration us>[ <detail>]
+ *
+ * Start is CLOCK_MONOTONIC, so lines of all invocations during a boot can
+ * be merged and sorted into one profile. Each line is a single write to
+ * a file opened for appending, so concurrent tools don't mix lines up.
+ * A phase that fails is recorded too, with "error: <reason>" after its
+ * detail. With INITRD_TRACE unset a phase costs one branch.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *trace_tool;
+static int trace_fd = -1;
+
+/* Starts tracing as tool if INITRD_TRACE asks for it */
+static void trace_init(const char *tool) {
+	const char *path = getenv("INITRD_TRACE");
+	if (path == NULL || path[0] == '\0') {
+		return;
+	}
+	trace_tool = tool;
+	trace_fd = strcmp(path, "-") == 0 ? STDERR_FILENO :
+		open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (trace_fd < 0) {
+		perror("Could not open INITRD_TRACE file");
+	}
+}
+
+/* Returns monotonic time in us, 0 when not tracing */
+static uint64_t trace_now(void) {
+	if (trace_fd < 0) {
+		return 0;
+	}
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Records phase that started at trace_now() time start, detail may be NULL */
+static void trace_end(const char *phase, const char *detail, const uint64_t start) {
+	if (trace_fd < 0) {
+		return;
+	}
+	char line[256];
+	int len = snprintf(line, sizeof(line), "%s %ld %s %llu %llu%s%.128s\n",
+		trace_tool, (long)getpid(), phase, (unsigned long long)start,
+		(unsigned long long)(trace_now() - start), detail != NULL ? " " : "",
+		detail != NULL ? detail : "");
+	len = len < (int)sizeof(line) ? len : (int)sizeof(line) - 1;
+	if (write(trace_fd, line, len) != len) {
+		/* losing a trace line must not fail the tool */
+	}
+}
+
+/* Records phase that failed for reason, e.g. strerror(errno), detail may be NULL */
+static void trace_error(const char *phase, const char *detail, const char *reason,
+		const uint64_t start) {
+	if (trace_fd < 0) {
+		return;
+	}
+	char error[128];
+	snprintf(error, sizeof(error), "%s%serror: %s", detail != NULL ? detail : "",
+		detail != NULL ? " " : "", reason);
+	trace_end(phase, error, start);
+}
+
+#endif